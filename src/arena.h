@@ -0,0 +1,91 @@
+/**
+ * Bump allocator for short-lived allocations that are all released together, e.g everything allocated while
+ * processing a single upgrade request. The first block is a buffer provided by the caller, usually on the stack, so
+ * small workloads don't call malloc at all. Larger workloads overflow into heap blocks.
+ */
+#ifndef NITROWS_SRC_ARENA_H
+#define NITROWS_SRC_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGNMENT (sizeof(void *) > sizeof(int64_t) ? sizeof(void *) : sizeof(int64_t))
+
+typedef struct arena_block ArenaBlock;
+
+// Header of a heap block. Its data follows the header.
+struct arena_block {
+  ArenaBlock *next;
+};
+
+typedef struct arena Arena;
+
+struct arena {
+  uint8_t *data;       // Block currently allocated from
+  size_t used;         // Bytes used in the current block
+  size_t capacity;     // Size of the current block
+  ArenaBlock *blocks;  // Heap blocks, most recent first
+};
+
+/**
+ * Initialize an arena with the buffer it allocates from first.
+ *
+ * @param arena Arena to initialize
+ * @param buffer Caller owned buffer. It must outlive the arena.
+ * @param size Size of buffer
+ */
+static inline void arena_init(Arena *arena, void *buffer, size_t size) {
+  arena->data = (uint8_t *)buffer;
+  arena->used = 0;
+  arena->capacity = size;
+  arena->blocks = NULL;
+}
+
+/**
+ * Allocate zeroed memory from an arena. It is released along with everything else in the arena.
+ *
+ * @param arena Arena to allocate from
+ * @param size Number of bytes to allocate
+ *
+ * @returns pointer to the memory. NULL if a heap block can't be allocated.
+ */
+static inline void *arena_alloc(Arena *arena, size_t size) {
+  size_t start = (arena->used + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+  if (start + size > arena->capacity) {
+    size_t header_size = (sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    size_t capacity = size > ARENA_BLOCK_SIZE - header_size ? size + header_size : ARENA_BLOCK_SIZE;
+    ArenaBlock *block = (ArenaBlock *)malloc(capacity);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->data = (uint8_t *)block;
+    arena->capacity = capacity;
+    start = header_size;
+  }
+  arena->used = start + size;
+  return memset(arena->data + start, 0, size);
+}
+
+/**
+ * Release everything allocated from an arena. The arena can't be used afterwards until it is initialized again.
+ *
+ * @param arena Arena to release
+ */
+static inline void arena_release(Arena *arena) {
+  ArenaBlock *next = NULL;
+  while (arena->blocks != NULL) {
+    next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->data = NULL;
+  arena->used = 0;
+  arena->capacity = 0;
+}
+
+#endif
@@ -5,6 +5,9 @@
 
 #include "extension.h"
 
+// Generation of the last client created. The first one is 1, so 0 can stand for whichever client has a socket.
+static uint64_t last_client_generation;
+
 Client *init_client(int socketfd, uint8_t *extension_indices, uint8_t indices_count) {
   // We are going to use socketfd as the hashtable key
   int index = socketfd % HASHTABLE_SIZE;
@@ -17,9 +20,11 @@ Client *init_client(int socketfd, uint8_t *extension_indices, uint8_t indices_co
 
   // Initialize the client with some of its members default values.
   client->socketfd = socketfd;
+  client->generation = ++last_client_generation;
   client->indices_count = indices_count;
   client->extension_indices = extension_indices;
   client->status = CONNECTED;
+  client->rtt = -1;
   client->current_frame_type = NO_FRAME;
   client->data_frame.type = INVALID;
   client->control_frame.type = INVALID;
@@ -56,6 +61,25 @@ Client *get_client(int socketfd) {
   return node->client;
 }
 
+void free_pending_messages(Client *client) {
+  PendingMessage *pending = client->pending_head;
+  PendingMessage *next = NULL;
+  while (pending != NULL) {
+    next = pending->next;
+    free(pending->data);
+    free(pending);
+    pending = next;
+  }
+  free(client->pending_index);
+  client->pending_head = NULL;
+  client->pending_tail = NULL;
+  client->pending_bytes = 0;
+  client->pending_index = NULL;
+  client->pending_index_size = 0;
+  client->pending_keyed_count = 0;
+  client->pending_expiry = 0;
+}
+
 void __free_client(Client *client) {
   if (client->data_frame.buffer != NULL) {
     free(client->data_frame.buffer);
@@ -63,14 +87,12 @@ void __free_client(Client *client) {
   if (client->control_frame.buffer != NULL) {
     free(client->control_frame.buffer);
   }
-  if (client->output_frame.buffer != NULL) {
-    free(client->output_frame.buffer);
-  }
   if (client->send_buffer != NULL) {
     free(client->send_buffer);
   }
+  free_pending_messages(client);
 
-  if (client->indices_count > 0) {
+  if (uses_extensions(client)) {
     Extension *extension;
     for (uint8_t i = 0; i < client->indices_count; i++) {
       extension = get_extension(client->extension_indices[i]);
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include "./defs.h"
+#include "./timer.h"
 
 #define NO_FRAME (-1)
 #define CONTROL_FRAME 0
@@ -43,6 +44,26 @@ struct Frame {
   uint64_t buffer_size;
   uint64_t current_fragment_offset;  // Where current fragment starts
   uint8_t *buffer;
+
+  // Close status an extension wants the connection closed with when it rejects the frame. INVALID_EXTENSION is used
+  // if it isn't set.
+  Status_code close_code;
+};
+
+typedef struct PendingMessage PendingMessage;
+
+/**
+ * A message waiting for a client's send buffer to drain. It isn't framed or compressed until it's moved to the send
+ * buffer, so it can still be replaced by a newer message with the same key or dropped once it expires.
+ */
+struct PendingMessage {
+  PendingMessage *next;
+  PendingMessage *next_in_bucket;  // Next message with a key in the same bucket of the client's index
+  uint64_t key;                    // 0 if it can't be replaced
+  uint64_t expires_at;             // get_time_ms time it's dropped at if it's still waiting. 0 if it never expires.
+  Opcode type;
+  uint64_t length;
+  uint8_t *data;
 };
 
 typedef struct Client Client;
@@ -87,12 +108,63 @@ struct Client {
   Frame control_frame;
   Frame data_frame;
 
+  // Payload of the latest ping in the data being processed. Only that ping is answered, once all of it is handled.
+  bool is_pong_due;
+  uint8_t pong_payload_size;
+  uint8_t pong_payload[CONTROL_FRAME_BUFFER_SIZE];
+
+  // Header info of the data frame being sent. Extensions set its rsv bits.
   Frame output_frame;
 
-  // Socket is non-blocking. We need a place to store data to be sent until it's sent.
+  // Socket is non-blocking. We need a place to store data to be sent until it's sent. Data before send_start was
+  // already sent and the buffer has room for send_buffer_capacity bytes.
   uint64_t send_buffer_size;
   uint64_t send_start;
+  uint64_t send_buffer_capacity;
   uint8_t *send_buffer;
+
+  // Control frames go into the send buffer at the next frame boundary, ahead of data that hasn't started. Data frames
+  // are only appended whole, so the boundaries are found from the frame headers. send_frame_end is where the frame
+  // being sent ends and send_control_end where the control frames waiting behind it end. A pong among them that
+  // hasn't started is pong_size bytes long at pong_start, so a newer pong can replace it.
+  uint64_t send_frame_end;
+  uint64_t send_control_end;
+  uint64_t pong_start;
+  uint8_t pong_size;
+
+  // Messages waiting behind the send buffer, oldest first, and the size of their payloads. The ones with a key are
+  // also in pending_index, a hashtable of pending_index_size buckets, so a newer message finds the one it replaces
+  // right away. pending_expiry is the earliest time any of them expires at, 0 if none does.
+  PendingMessage *pending_head;
+  PendingMessage *pending_tail;
+  uint64_t pending_bytes;
+  PendingMessage **pending_index;
+  uint32_t pending_index_size;
+  uint32_t pending_keyed_count;
+  uint64_t pending_expiry;
+
+  // A message was refused because the send buffer was over the high watermark. The writable handler runs once it
+  // drains to the low watermark.
+  bool is_send_blocked;
+
+  // The application paused reading, so data the client sends stays in the socket
+  bool is_reading_paused;
+
+  // Idle timeout while connected, close handshake timeout once closing
+  Timer timer;
+
+  // Heartbeat. A ping carries the time it was sent, which the client echoes back in its pong.
+  Timer heartbeat_timer;
+  uint64_t last_ping_time;  // When the last ping was sent in microseconds. 0 once it's answered
+  uint8_t missed_pongs;     // Pings sent since the last answer
+  int64_t rtt;              // Round trip time of the last answered ping in microseconds. -1 until one is answered
+
+  // Set by the application and handed to its handlers
+  void *userdata;
+
+  // Never reused, unlike the socket descriptor. Other threads tag what they queue for a client with it, so it doesn't
+  // reach a later client that got the same descriptor.
+  uint64_t generation;
 };
 
 typedef struct Node Node;
@@ -131,6 +203,13 @@ Client *init_client(int socketfd, uint8_t *extension_indices, uint8_t indices_co
  */
 Client *get_client(int socketfd);
 
+/**
+ * Free the messages waiting to be sent to a client.
+ *
+ * @param client Pointer to client struct
+ */
+void free_pending_messages(Client *client);
+
 /**
  * Delete a client from the client table. Once that's done, free its members
  * and it.
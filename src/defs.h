@@ -33,6 +33,38 @@ enum {
 
   // Listener backlog for the listen call. Shamelessly copied from nginx
   LISTEN_BACKLOG = 511,
+
+  // Most connections accepted for a single listener event, so a connection storm doesn't starve connected clients.
+  // Connections left in the backlog are accepted after the other ready sockets are handled.
+  ACCEPT_BATCH_SIZE = 64,
+
+  // Most sockets the server can listen on, the TCP port and unix domain sockets together
+  MAX_LISTENERS = 8,
+
+  // Default most unsent bytes queued in the kernel for a connection
+  DEFAULT_NOTSENT_LOWAT = 16384,
+
+  // Default milliseconds a new connection has to complete its handshake
+  HANDSHAKE_TIMEOUT = 10000,
+
+  // Default milliseconds a client has to answer our close frame before the connection is closed anyway
+  CLOSE_TIMEOUT = 5000,
+
+  // Default number of heartbeat pings a client can leave unanswered before the connection is closed
+  MAX_MISSED_PONGS = 3,
+
+  // Most messages queued by other threads that are sent per wakeup of the event loop, so a flood of them doesn't
+  // starve connected clients
+  SEND_QUEUE_BATCH_SIZE = 256,
+
+  // Default most bytes queued for a client before messages to it are refused, and the size its queue has to drain to
+  // before the writable handler runs
+  SEND_HIGH_WATERMARK = 16 * 1024 * 1024,
+  SEND_LOW_WATERMARK = 4 * 1024 * 1024,
+
+  // Initial number of buckets in the index of a client's pending messages by key. It doubles whenever it holds as many
+  // messages as it has buckets.
+  PENDING_INDEX_SIZE = 16,
 };
 
 typedef enum Opcode Opcode;
@@ -69,4 +101,9 @@ enum Status_code {
 typedef enum Connection_status Connection_status;
 enum Connection_status { CONNECTED = 0, CLOSING, CLOSED };
 
+typedef enum Send_status Send_status;
+// Result of sending a message. SEND_FAILED is 0, so checking the result as a boolean still catches failures.
+// SEND_WOULD_EXCEED means the message was dropped because the client's queue is over the high watermark.
+enum Send_status { SEND_FAILED = 0, SEND_OK, SEND_WOULD_EXCEED };
+
 #endif  // Included defs.h
\ No newline at end of file
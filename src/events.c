@@ -1,7 +1,128 @@
 #include "./events.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "./timer.h"
+
+void init_wakeup() {
+#ifdef __linux__
+  wakeup_fds[0] = wakeup_fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup_fds[0] == -1) {
+    perror("eventfd");
+    exit(1);
+  }
+#else
+  if (pipe(wakeup_fds) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(wakeup_fds[i], F_SETFL, fcntl(wakeup_fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(wakeup_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  add_to_event_loop(wakeup_fds[0]);
+}
+
+void signal_wakeup() {
+  // A full pipe or eventfd counter already wakes the loop, so a failed write is fine
+  uint64_t value = 1;
+#ifdef __linux__
+  ssize_t written = write(wakeup_fds[1], &value, sizeof(value));
+#else
+  ssize_t written = write(wakeup_fds[1], &value, 1);
+#endif
+  (void)written;
+}
+
+/**
+ * Reset the wakeup descriptor so the next signal is reported again.
+ */
+void __clear_wakeup() {
+  uint8_t buffer[64];
+#ifdef __linux__
+  ssize_t nbytes = read(wakeup_fds[0], buffer, sizeof(uint64_t));
+  (void)nbytes;
+#else
+  while (read(wakeup_fds[0], buffer, sizeof(buffer)) > 0) {
+  }
+#endif
+}
+
+void set_event_handlers(int *listeners, uint8_t listener_count, bool (*handle_listener)(int),
+                        void (*handle_others)(int, bool, bool), void (*handle_wakeup)()) {
+  if (listener_count > MAX_LISTENERS) {
+    listener_count = MAX_LISTENERS;
+  }
+  memcpy(event_handlers.listeners, listeners, listener_count * sizeof(int));
+  event_handlers.listener_count = listener_count;
+  event_handlers.handle_listener = handle_listener;
+  event_handlers.handle_others = handle_others;
+  event_handlers.handle_wakeup = handle_wakeup;
+  event_handlers.pending_listeners = 0;
+}
+
+/**
+ * Find which listener a descriptor is.
+ *
+ * @returns index of the listener. -1 if the descriptor isn't one.
+ */
+int __get_listener_index(int fd) {
+  for (int i = 0; i < event_handlers.listener_count; i++) {
+    if (event_handlers.listeners[i] == fd) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int get_event_loop_timeout() {
+  // Waiting connections the listeners left behind are accepted without waiting
+  if (event_handlers.pending_listeners != 0) {
+    return 0;
+  }
+  return get_timer_timeout();
+}
+
+/**
+ * Accept the waiting connections of a listener and remember whether it left some behind.
+ */
+void __handle_listener(int index) {
+  int listener = event_handlers.listeners[index];
+  if (event_handlers.handle_listener(listener)) {
+    event_handlers.pending_listeners |= UINT32_C(1) << index;
+  } else {
+    event_handlers.pending_listeners &= ~(UINT32_C(1) << index);
+  }
+}
+
+/**
+ * Get how long a step can wait, the shorter of the caller's timeout and the loop's own. Negative timeouts wait forever.
+ */
+int __get_wait_timeout(int timeout) {
+  int loop_timeout = get_event_loop_timeout();
+  if (timeout < 0 || (loop_timeout >= 0 && loop_timeout < timeout)) {
+    return loop_timeout;
+  }
+  return timeout;
+}
+
+void run_event_loop() {
+  while (1) {
+    if (step_event_loop(-1) == -1) {
+      perror("event loop");  // TODO(goody): change this
+      exit(1);               // Remove this
+    }
+  }
+}
 
 #ifdef __linux__
 void init_event_loop() {
@@ -37,35 +158,62 @@ void set_write_notify(int socketfd, bool enable) {
   }
 }
 
+void set_read_notify(int socketfd, bool enable) {
+  // New data is reported once when it arrives and the handler of a paused socket ignores it. Leaving EPOLLIN set saves
+  // a system call on every pause and resume.
+  (void)socketfd;
+  (void)enable;
+}
+
 void delete_from_event_loop(int socketfd) {
   // Closing a socket automatically removes it from the epoll set. We maintain this empty function because it is called
   // in a platform agnostic manner. Other platforms requires explicit removal.
 }
 
-void run_event_loop(int listener, void (*handle_listener)(int), void (*handle_others)(int, bool, bool)) {
+int get_event_loop_fd() { return epollfd; }
+
+int step_event_loop(int timeout) {
+  EventHandlers *handlers = &event_handlers;
   struct epoll_event curr_event;
-  while (1) {
-    int event_count = epoll_wait(epollfd, nitrows_event.objects, INITIAL_EVENT_SIZE, -1);
-    if (event_count == -1) {
-      perror("epoll_wait");  // TODO(goody): change this
-      exit(1);               // Remove this
-    }
+  int event_count = epoll_wait(epollfd, nitrows_event.objects, INITIAL_EVENT_SIZE, __get_wait_timeout(timeout));
+  if (event_count == -1) {
+    return (errno == EINTR) ? 0 : -1;
+  }
 
-    for (int i = 0; i < event_count; i++) {
-      curr_event = nitrows_event.objects[i];
-      if (curr_event.data.fd == listener) {
-        handle_listener(listener);
-      } else {
-        if (curr_event.events & EPOLLIN) {
-          handle_others(curr_event.data.fd, false, false);
-        } else if (curr_event.events & EPOLLOUT) {
-          handle_others(curr_event.data.fd, true, false);
-        } else if ((curr_event.events & EPOLLHUP) || (curr_event.events & EPOLLERR)) {
-          handle_others(curr_event.data.fd, false, true);
-        }
+  uint32_t handled_listeners = 0;
+  int listener_index;
+  for (int i = 0; i < event_count; i++) {
+    curr_event = nitrows_event.objects[i];
+    if ((listener_index = __get_listener_index(curr_event.data.fd)) != -1) {
+      __handle_listener(listener_index);
+      handled_listeners |= UINT32_C(1) << listener_index;
+    } else if (curr_event.data.fd == wakeup_fds[0]) {
+      __clear_wakeup();
+      handlers->handle_wakeup();
+    } else {
+      // Edge triggered events aren't reported again, so a socket that is both readable and writable has both handled
+      if (curr_event.events & EPOLLIN) {
+        handlers->handle_others(curr_event.data.fd, false, false);
+      }
+      if (curr_event.events & EPOLLOUT) {
+        handlers->handle_others(curr_event.data.fd, true, false);
+      }
+      if (!(curr_event.events & (EPOLLIN | EPOLLOUT)) &&
+          ((curr_event.events & EPOLLHUP) || (curr_event.events & EPOLLERR))) {
+        handlers->handle_others(curr_event.data.fd, false, true);
       }
     }
   }
+  // The listener is edge triggered, so connections left in the backlog by a capped accept batch don't produce another
+  // event. The loop doesn't wait while there might be some and accepts them after the other ready sockets.
+  uint32_t pending = handlers->pending_listeners & ~handled_listeners;
+  while (pending != 0) {
+    listener_index = __builtin_ctz(pending);
+    pending &= pending - 1;
+    __handle_listener(listener_index);
+  }
+  run_timers();
+  return event_count;
 }
 #elif defined(__unix__) || defined(__APPLE__)
 void init_event_loop() {
@@ -123,6 +271,33 @@ void set_write_notify(int socketfd, bool enable) {
   }
 }
 
+void set_read_notify(int socketfd, bool enable) {
+  int i;
+  for (i = 0; i < nitrows_event.count; i++) {
+    if (nitrows_event.objects[i].ident == socketfd) {
+      break;
+    }
+  }
+
+  if (i == nitrows_event.count) {
+    return;
+  }
+
+  // The read filter is level triggered, so it has to be disabled or a paused socket would be reported over and over
+  if (enable) {
+    nitrows_event.objects[i].flags &= ~EV_DISABLE;
+    nitrows_event.objects[i].flags |= EV_ENABLE;
+  } else {
+    nitrows_event.objects[i].flags &= ~EV_ENABLE;
+    nitrows_event.objects[i].flags |= EV_DISABLE;
+  }
+
+  int err = kevent(kq, nitrows_event.objects, nitrows_event.count, NULL, 0, NULL);
+  if (err < 0) {
+    perror("kevent");
+  }
+}
+
 void delete_from_event_loop(int socketfd) {
   int index = -1;
   // If index is negative, we need to search for the object containing the
@@ -161,30 +336,39 @@ void delete_from_event_loop(int socketfd) {
   }
 }
 
-void run_event_loop(int listener, void (*handle_listener)(int), void (*handle_others)(int, bool, bool)) {
+int get_event_loop_fd() { return kq; }
+
+int step_event_loop(int timeout) {
+  EventHandlers *handlers = &event_handlers;
   struct kevent curr_event;
-  while (1) {
-    int event_count = kevent(kq, NULL, 0, nitrows_event.outs, INITIAL_EVENT_SIZE, NULL);
-    if (event_count == -1) {
-      perror("kevent");  // TODO(goody): change this
-      exit(1);           // Remove this
-    }
+  struct timespec wait_time;
+  int timeout_ms = __get_wait_timeout(timeout);
+  wait_time.tv_sec = timeout_ms / 1000;
+  wait_time.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  int event_count = kevent(kq, NULL, 0, nitrows_event.outs, INITIAL_EVENT_SIZE, timeout_ms < 0 ? NULL : &wait_time);
+  if (event_count == -1) {
+    return (errno == EINTR) ? 0 : -1;
+  }
 
-    for (int i = 0; i < event_count; i++) {
-      curr_event = nitrows_event.outs[i];
-      if (curr_event.ident == listener) {
-        handle_listener(listener);
-      } else {
-        if (curr_event.filter == EVFILT_READ) {
-          handle_others(curr_event.ident, false, false);
-        } else if (curr_event.filter == EVFILT_WRITE) {
-          handle_others(curr_event.ident, true, false);
-        } else if (curr_event.flags & EV_EOF) {
-          handle_others(curr_event.ident, false, true);
-        }
+  for (int i = 0; i < event_count; i++) {
+    curr_event = nitrows_event.outs[i];
+    if (__get_listener_index(curr_event.ident) != -1) {
+      handlers->handle_listener(curr_event.ident);
+    } else if (curr_event.ident == wakeup_fds[0]) {
+      __clear_wakeup();
+      handlers->handle_wakeup();
+    } else {
+      if (curr_event.filter == EVFILT_READ) {
+        handlers->handle_others(curr_event.ident, false, false);
+      } else if (curr_event.filter == EVFILT_WRITE) {
+        handlers->handle_others(curr_event.ident, true, false);
+      } else if (curr_event.flags & EV_EOF) {
+        handlers->handle_others(curr_event.ident, false, true);
       }
     }
   }
+  run_timers();
+  return event_count;
 }
 #else
 void init_event_loop() {
@@ -227,6 +411,26 @@ void set_write_notify(int socketfd, bool enable) {
   }
 }
 
+void set_read_notify(int socketfd, bool enable) {
+  int i;
+  for (i = 0; i < nitrows_event.count; i++) {
+    if (nitrows_event.objects[i].fd == socketfd) {
+      break;
+    }
+  }
+
+  if (i == nitrows_event.count) {
+    return;
+  }
+
+  // poll is level triggered, so a paused socket would be reported over and over
+  if (enable) {
+    nitrows_event.objects[i].events |= POLLIN;
+  } else {
+    nitrows_event.objects[i].events &= ~POLLIN;
+  }
+}
+
 void delete_from_event_loop(int socketfd) {
   int index = -1;
   // If index is negative, we need to search for the object containing the
@@ -264,28 +468,36 @@ void delete_from_event_loop(int socketfd) {
   }
 }
 
-void run_event_loop(int listener, void (*handle_listener)(int), void (*handle_others)(int, bool, bool)) {
-  while (1) {
-    int poll_count = poll(nitrows_event.objects, nitrows_event.count, -1);
-    if (poll_count == -1) {
-      perror("poll");  // TODO(goody): change this
-      exit(1);         // Remove this
-    }
+int get_event_loop_fd() {
+  // poll has no descriptor of its own to watch
+  return -1;
+}
+
+int step_event_loop(int timeout) {
+  EventHandlers *handlers = &event_handlers;
+  int poll_count = poll(nitrows_event.objects, nitrows_event.count, __get_wait_timeout(timeout));
+  if (poll_count == -1) {
+    return (errno == EINTR) ? 0 : -1;
+  }
 
-    for (int i = 0; i < nitrows_event.count; i++) {
-      // Check to see if any is ready and handle them with their
-      // respective functions
-      if (nitrows_event.objects[i].revents & POLLIN) {
-        if (nitrows_event.objects[i].fd == listener) {
-          // We handle listener socket differently.
-          handle_listener(listener);
-        } else {
-          handle_others(nitrows_event.objects[i].fd, false, false);
-        }
-      } else if (nitrows_event.objects[i].revents & POLLOUT) {
-        handle_others(nitrows_event.objects[i].fd, true, false);
+  for (int i = 0; i < nitrows_event.count; i++) {
+    // Check to see if any is ready and handle them with their
+    // respective functions
+    if (nitrows_event.objects[i].revents & POLLIN) {
+      if (__get_listener_index(nitrows_event.objects[i].fd) != -1) {
+        // We handle listener sockets differently.
+        handlers->handle_listener(nitrows_event.objects[i].fd);
+      } else if (nitrows_event.objects[i].fd == wakeup_fds[0]) {
+        __clear_wakeup();
+        handlers->handle_wakeup();
+      } else {
+        handlers->handle_others(nitrows_event.objects[i].fd, false, false);
       }
+    } else if (nitrows_event.objects[i].revents & POLLOUT) {
+      handlers->handle_others(nitrows_event.objects[i].fd, true, false);
     }
   }
+  run_timers();
+  return poll_count;
 }
 #endif
\ No newline at end of file
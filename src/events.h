@@ -12,6 +12,8 @@
 #include <poll.h>
 #endif
 
+#include "./defs.h"
+
 // Initial number of sockets to be monitored by our event library.
 #define INITIAL_EVENT_SIZE 16
 
@@ -50,6 +52,31 @@ struct Event {
 #endif
 
 static Event nitrows_event;
+
+// Descriptors other threads use to wake up the event loop. The loop watches the first one and they write to the
+// second. Both are the same eventfd on Linux and the two ends of a pipe elsewhere.
+static int wakeup_fds[2] = {-1, -1};
+
+/**
+ * Functions the event loop hands ready descriptors to.
+ */
+typedef struct EventHandlers EventHandlers;
+
+struct EventHandlers {
+  int listeners[MAX_LISTENERS];
+  uint8_t listener_count;
+  // Runs if it's a listener socket that is ready to be read. It returns true if it stopped before accepting every
+  // waiting connection.
+  bool (*handle_listener)(int);
+  void (*handle_others)(int, bool, bool);  // Runs if it's other sockets
+  void (*handle_wakeup)();                 // Runs when another thread woke up the loop
+
+  // Bit i is set if listener i has waiting connections that haven't produced an event
+  uint32_t pending_listeners;
+};
+
+static EventHandlers event_handlers;
+
 /**
  * This function creates our event loop. We allocate space for 16 of the events
  * objects.
@@ -72,6 +99,15 @@ void add_to_event_loop(int socketfd);
  */
 void set_write_notify(int socketfd, bool enable);
 
+/**
+ * This function enables or disables the read availability detection for a socket. epoll is edge triggered, so it keeps
+ * reporting new data there and the socket's handler has to ignore it.
+ *
+ * @param socketfd socket descriptor to enable or disable read availability detection
+ * @param enable Boolean to enable or disable read availability detection.
+ */
+void set_read_notify(int socketfd, bool enable);
+
 /**
  * Deletes file descriptor from event loop. We will decrease the event object
  * array size if the number of file descriptors falls below a chosen threshold.
@@ -81,13 +117,57 @@ void set_write_notify(int socketfd, bool enable);
 void delete_from_event_loop(int socketfd);
 
 /**
- * Runs the event loop. If any of the file descriptor is ready, we handle
- * them with any of the handler functions.
+ * Create the descriptor other threads use to wake up the event loop and add it to the loop.
+ */
+void init_wakeup();
+
+/**
+ * Wake up the event loop. Safe to call from any thread.
+ */
+void signal_wakeup();
+
+/**
+ * Set the functions that handle ready descriptors. It must be called before the loop runs.
  *
- * @param listener listener socket
- * @param handle_listener function that runs if it's the listener socket
- * that is ready to be read.
+ * @param listeners listener sockets
+ * @param listener_count number of listener sockets, MAX_LISTENERS at most
+ * @param handle_listener function that runs if it's a listener socket
+ * that is ready to be read. It returns true if it stopped before accepting
+ * every waiting connection.
  * @param handle_others function that runs if it's other sockets.
+ * @param handle_wakeup function that runs when another thread woke up the loop.
+ */
+void set_event_handlers(int *listeners, uint8_t listener_count, bool (*handle_listener)(int),
+                        void (*handle_others)(int, bool, bool), void (*handle_wakeup)());
+
+/**
+ * Get the descriptor of the event loop. It's readable whenever a descriptor the loop watches is ready, so the loop
+ * can be watched by another one.
+ *
+ * @returns epoll or kqueue descriptor. -1 if the loop uses poll, which has none.
+ */
+int get_event_loop_fd();
+
+/**
+ * Get how long the event loop can wait before it has work to do other than handling ready descriptors.
+ *
+ * @returns milliseconds until the next timer needs attention. 0 if there's work already, -1 if there are no timers.
  */
-void run_event_loop(int listener, void (*handle_listener)(int), void (*handle_others)(int, bool, bool));
-#endif
\ No newline at end of file
+int get_event_loop_timeout();
+
+/**
+ * Run a single iteration of the event loop. It waits for descriptors to be ready, handles them with the handler
+ * functions and runs the timers that expired. It never waits past the next timer.
+ *
+ * @param timeout milliseconds to wait at most. 0 doesn't wait and -1 waits until there's work.
+ *
+ * @returns number of ready descriptors. -1 on error, with errno set.
+ */
+int step_event_loop(int timeout);
+
+/**
+ * Runs the event loop forever. If any of the file descriptor is ready, we handle
+ * them with the handler functions.
+ */
+void run_event_loop();
+#endif
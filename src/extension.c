@@ -4,10 +4,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Scratch buffers handed out by get_extension_buffer
+static ExtensionBuffer extension_buffers[EXTENSION_BUFFER_COUNT];
+
 void register_extension(char *key, bool (*validate_offer)(int, ExtensionParam *),
                         uint16_t (*respond_to_offer)(int, char *),
-                        bool (*process_data)(int, Frame *, uint8_t **, uint64_t *),
-                        uint64_t (*generate_data)(int, uint8_t *, uint64_t, Frame *), void (*close)(int)) {
+                        ExtensionResult (*process_data)(int, Frame *, ExtensionBuffer *),
+                        ExtensionResult (*generate_data)(int, uint8_t *, uint64_t, ExtensionBuffer *, Frame *),
+                        bool (*stream_data)(int, Frame *, void (*)(int, uint8_t *, uint64_t, bool)),
+                        void (*close)(int)) {
   if (extension_count == 0) {
     extension_table = (Extension *)malloc(sizeof(Extension));
     extension_table[0].key = strdup(key);
@@ -15,6 +20,7 @@ void register_extension(char *key, bool (*validate_offer)(int, ExtensionParam *)
     extension_table[0].respond_to_offer = respond_to_offer;
     extension_table[0].process_data = process_data;
     extension_table[0].generate_data = generate_data;
+    extension_table[0].stream_data = stream_data;
     extension_table[0].close = close;
     extension_count = 1;
   } else {
@@ -30,6 +36,7 @@ void register_extension(char *key, bool (*validate_offer)(int, ExtensionParam *)
     extension_table[extension_count].respond_to_offer = respond_to_offer;
     extension_table[extension_count].process_data = process_data;
     extension_table[extension_count].generate_data = generate_data;
+    extension_table[extension_count].stream_data = stream_data;
     extension_table[extension_count].close = close;
     extension_count++;
   }
@@ -42,95 +49,49 @@ Extension *get_extension(uint8_t index) {
   return &extension_table[index];
 }
 
-int16_t find_extension_functions(char *key) {
-  if (extension_count == 0) {
-    return -1;
+ExtensionBuffer *get_extension_buffer(uint8_t index) { return &extension_buffers[index]; }
+
+bool reserve_extension_buffer(ExtensionBuffer *buffer, uint64_t size) {
+  if (buffer->capacity - buffer->length >= size) {
+    return true;
   }
-  for (int8_t i = 0; i < extension_count; i++) {
-    if (strcmp(key, extension_table[i].key) == 0) {
-      return i;
-    }
+  uint64_t capacity = buffer->capacity * 2;
+  if (capacity < buffer->length + size) {
+    capacity = buffer->length + size;
   }
-  return -1;
+  uint8_t *temp = (uint8_t *)realloc(buffer->data, capacity);
+  if (temp == NULL) {
+    return false;
+  }
+  buffer->data = temp;
+  buffer->capacity = capacity;
+  return true;
 }
 
-ExtensionList *get_extension_list(int socketfd) {
-  // We get the index of the client using the socket descriptor as
-  // key. We then search the linked list to get the node containing
-  // the client.
-  int index = socketfd % WAITING_CLIENT_TABLE_SIZE;
-  WaitingClient *client = waiting_clients_table[index];
-  while (client != NULL) {
-    if (client->socketfd == socketfd) {
-      break;
+void shrink_extension_buffers(uint8_t index) {
+  for (uint8_t i = index; i < index + 2; i++) {
+    if (extension_buffers[i].capacity > EXTENSION_BUFFER_RETAIN_SIZE) {
+      free(extension_buffers[i].data);
+      extension_buffers[i].data = NULL;
+      extension_buffers[i].capacity = 0;
     }
-    client = client->next;
+    extension_buffers[i].length = 0;
   }
-
-  // If we can't find the client, then create new waiting client.
-  if (client == NULL) {
-    client = (WaitingClient *)malloc(sizeof(WaitingClient));
-    client->next = waiting_clients_table[index];
-    client->extensions = (ExtensionList *)calloc(1, sizeof(ExtensionList));
-    client->socketfd = socketfd;
-    waiting_clients_table[index] = client;
-  }
-  return client->extensions;
 }
 
-void delete_extension_list(int socketfd) {
-  int index = socketfd % WAITING_CLIENT_TABLE_SIZE;
-
-  WaitingClient *prev = waiting_clients_table[index];
-  WaitingClient *current = NULL;
-
-  // Nothing is found in table. That will be strange.
-  if (prev == NULL) {
-    return;
-  }
-
-  // If node is at the beginning of the list. Set beginning of list to
-  // the next node. Free node.
-  if (prev->socketfd == socketfd) {
-    current = prev;
-    waiting_clients_table[index] = current->next;
-    free_extension_list(prev->extensions);
-    free(prev);
-    return;
+int16_t find_extension_functions(char *key) {
+  if (extension_count == 0) {
+    return -1;
   }
-
-  // Search for client in list
-  current = prev->next;
-  while (current != NULL) {
-    if (current->socketfd == socketfd) {
-      prev->next = current->next;
-      break;
+  for (int8_t i = 0; i < extension_count; i++) {
+    if (strcmp(key, extension_table[i].key) == 0) {
+      return i;
     }
-    prev = current;
-    current = current->next;
-  }
-  if (current != NULL) {
-    free_extension_list(current->extensions);
-    free(current);
   }
+  return -1;
 }
 
-void free_extension_list(ExtensionList *list) {
-  ExtensionList *next = NULL;
-  ExtensionParam *current = NULL;
-  ExtensionParam *next_param = NULL;
-  while (list != NULL) {
-    next = list->next;
-    current = list->params;
-    while (current != NULL) {
-      next_param = current->next;
-      free(current);
-      current = next_param;
-    }
-    free(list);
-    list = next;
-  }
-}
+ExtensionList *create_extension_list(Arena *arena) { return (ExtensionList *)arena_alloc(arena, sizeof(ExtensionList)); }
 
 bool validate_extension_list(int socketfd, ExtensionList *list, uint8_t **extension_indices, uint8_t *indices_count) {
   if (list == NULL || strlen(list->token) == 0 || extension_count == 0) {
@@ -183,12 +144,11 @@ bool validate_extension_list(int socketfd, ExtensionList *list, uint8_t **extens
   return true;
 }
 
-ExtensionParam *get_extension_params(ExtensionList *list, char *key, bool create) {
+ExtensionParam *get_extension_params(ExtensionList *list, char *key, bool create, Arena *arena) {
   if (strlen(list->token) == 0 && create) {
     strncpy(list->token, key, EXTENSION_TOKEN_LENGTH);
     list->token[EXTENSION_TOKEN_LENGTH] = '\0';
-    list->params = (ExtensionParam *)calloc(1, sizeof(ExtensionParam));
-    list->params->value_type = EMPTY;
+    list->params = (ExtensionParam *)arena_alloc(arena, sizeof(ExtensionParam));
     return list->params;
   }
 
@@ -203,13 +163,15 @@ ExtensionParam *get_extension_params(ExtensionList *list, char *key, bool create
 
   if (create) {
     if (list == NULL) {
-      prev->next = (ExtensionList *)calloc(1, sizeof(ExtensionList));
+      prev->next = (ExtensionList *)arena_alloc(arena, sizeof(ExtensionList));
       list = prev->next;
+      if (list == NULL) {
+        return NULL;
+      }
     }
     strncpy(list->token, key, EXTENSION_TOKEN_LENGTH);
     list->token[EXTENSION_TOKEN_LENGTH] = '\0';
-    list->params = (ExtensionParam *)calloc(1, sizeof(ExtensionParam));
-    list->params->value_type = EMPTY;
+    list->params = (ExtensionParam *)arena_alloc(arena, sizeof(ExtensionParam));
     return list->params;
   }
   return NULL;
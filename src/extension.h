@@ -7,10 +7,34 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "arena.h"
 #include "clients.h"
 
 #define EXTENSION_TOKEN_LENGTH 31
-#define WAITING_CLIENT_TABLE_SIZE 256
+// Extension buffers larger than this are released once a message is done with them.
+#define EXTENSION_BUFFER_RETAIN_SIZE (64 * 1024)
+
+/**
+ * Builds can be specialized for the extensions they support. NITROWS_NO_EXTENSIONS
+ * builds without extensions and NITROWS_DEFLATE_ONLY only supports
+ * permessage-deflate. Either way, the frame paths call the extension directly
+ * instead of looking it up in the extension table and calling it through a
+ * function pointer, and branches that can't be taken are compiled out. Custom
+ * extensions can't be registered in these builds.
+ */
+#if defined(NITROWS_NO_EXTENSIONS) && defined(NITROWS_DEFLATE_ONLY)
+#error "NITROWS_NO_EXTENSIONS and NITROWS_DEFLATE_ONLY can't be used together"
+#endif
+
+#if defined(NITROWS_NO_EXTENSIONS) || defined(NITROWS_DEFLATE_ONLY)
+#define NITROWS_SPECIALIZED_EXTENSIONS
+#endif
+
+#ifdef NITROWS_NO_EXTENSIONS
+#define uses_extensions(client) false
+#else
+#define uses_extensions(client) ((client)->indices_count > 0)
+#endif
 
 /**
  * A param value can be of any type. This enum defines the supported types.
@@ -66,16 +90,43 @@ struct extension_list {
   ExtensionParam *params;
 };
 
-typedef struct waiting_clients WaitingClient;
+/**
+ * Scratch buffer the library hands to extensions to write their output into.
+ * It is owned by the library and reused from message to message, so
+ * extensions don't allocate or free anything per message. Its content is
+ * only valid until the next message is processed.
+ */
+typedef struct extension_buffer ExtensionBuffer;
 
-struct waiting_clients {
-  int socketfd;
-  WaitingClient *next;
-  ExtensionList *extensions;
+struct extension_buffer {
+  uint8_t *data;
+  uint64_t length;    // Bytes written so far
+  uint64_t capacity;  // Bytes available in data
 };
 
-// Table containing all the connected clients.
-static WaitingClient *waiting_clients_table[WAITING_CLIENT_TABLE_SIZE];
+/**
+ * Index of the scratch buffers. Extensions are chained, each extension reads
+ * the output of the one before it, so every direction has a pair of buffers
+ * that are used in turns.
+ */
+enum { RECEIVE_BUFFER = 0, SEND_BUFFER = 2, EXTENSION_BUFFER_COUNT = 4 };
+
+/**
+ * Tells the library what an extension did with the data it was given.
+ */
+typedef enum ExtensionResult ExtensionResult;
+
+enum ExtensionResult {
+  // The data is invalid. The connection is closed with the frame's close_code.
+  EXTENSION_FAILED = 0,
+  // The data wasn't changed, so nothing is copied.
+  EXTENSION_UNCHANGED,
+  // The data was changed in its own buffer. Its new length is in the frame's
+  // filled_size. Only data sent by the client can be changed in place.
+  EXTENSION_IN_PLACE,
+  // The data was written to the scratch buffer.
+  EXTENSION_WRITTEN,
+};
 
 typedef struct Extension Extension;
 struct Extension {
@@ -90,16 +141,26 @@ struct Extension {
   // descriptor as the first parameter and an array of size 512.
   uint16_t (*respond_to_offer)(int, char *);
 
-  // This function processes data sent by the client. It returns true if
-  // valid, false otherwise. It accepts a socket descriptor, a frame array,
-  // length of frame array a pointer to the processed data, a pointer to the
-  // length of the processed data.
-  bool (*process_data)(int, Frame *, uint8_t **, uint64_t *);
+  // This function processes data sent by the client. It accepts a socket
+  // descriptor, the frame containing the data and a scratch buffer for its
+  // output. The data is in the frame's buffer and its length is the frame's
+  // filled_size. It returns what was done with the data. An extension that
+  // rewrites a text message is responsible for validating the UTF-8 of what
+  // it writes.
+  ExtensionResult (*process_data)(int, Frame *, ExtensionBuffer *);
 
   // Generates data to be sent to client. It accepts a socket descriptor, the
-  // raw data to be sent, the length of the raw data, a pointer to the
-  // output frame, returns the length of data written.
-  uint64_t (*generate_data)(int, uint8_t *, uint64_t, Frame *output_frame);
+  // raw data to be sent, the length of the raw data, a scratch buffer for its
+  // output and the output frame whose rsv bits it can set. The raw data
+  // belongs to the caller and must not be changed, so it returns either
+  // EXTENSION_UNCHANGED, EXTENSION_WRITTEN or EXTENSION_FAILED.
+  ExtensionResult (*generate_data)(int, uint8_t *, uint64_t, ExtensionBuffer *, Frame *output_frame);
+
+  // Optional. Processes data sent by the client like process_data, but hands
+  // the processed data to the provided function in chunks instead of
+  // writing it to a buffer. The last chunk has its final flag set. It is
+  // only used for the last extension of a client when a chunk handler is set.
+  bool (*stream_data)(int, Frame *, void (*)(int, uint8_t *, uint64_t, bool));
 
   // Closes and releases all resources associated with a particular socket
   // descriptor.
@@ -119,13 +180,17 @@ static int8_t extension_count = 0;
  * @param respond_to_offer: Handler for generating a response to a negotiation
  * offer.
  * @param process_data: Handler for processing client request.
+ * @param generate_data: Handler for generating data sent to the client.
+ * @param stream_data: Optional handler for processing client request in chunks. Can be NULL.
  * @param close: Handler for closing and releasing resources associated with a
  * client.
  */
 void register_extension(char *key, bool (*validate_offer)(int, ExtensionParam *),
                         uint16_t (*respond_to_offer)(int, char *),
-                        bool (*process_data)(int, Frame *, uint8_t **, uint64_t *),
-                        uint64_t (*generate_data)(int, uint8_t *, uint64_t, Frame *), void (*close)(int));
+                        ExtensionResult (*process_data)(int, Frame *, ExtensionBuffer *),
+                        ExtensionResult (*generate_data)(int, uint8_t *, uint64_t, ExtensionBuffer *, Frame *),
+                        bool (*stream_data)(int, Frame *, void (*)(int, uint8_t *, uint64_t, bool)),
+                        void (*close)(int));
 
 /**
  * Making extension table static means it's not available to other module. This
@@ -135,27 +200,37 @@ void register_extension(char *key, bool (*validate_offer)(int, ExtensionParam *)
 Extension *get_extension(uint8_t index);
 
 /**
- * Get a waiting client from the waiting client table. If none, add
- * a new one to the table and return the extension headers list
+ * Get one of the scratch buffers extensions write their output to.
  *
- * @param socketfd Client socket descriptor
- * @return Header Extension list
+ * @param index RECEIVE_BUFFER or SEND_BUFFER, plus one for the second buffer of the pair
+ * @return Scratch buffer
  */
-ExtensionList *get_extension_list(int socketfd);
+ExtensionBuffer *get_extension_buffer(uint8_t index);
 
 /**
- * Delete extension list and its containing waiting client from the table.
+ * Make sure an extension buffer has room for at least @param size more bytes. The buffer grows geometrically.
  *
- * @param client Pointer to client struct
+ * @param buffer Extension buffer
+ * @param size Number of bytes that will be written after the buffer's length
+ * @return false if there's no memory for it.
  */
-void delete_extension_list(int socketfd);
+bool reserve_extension_buffer(ExtensionBuffer *buffer, uint64_t size);
 
 /**
- * Free extension list and its params
+ * Release the pair of extension buffers starting at @param index if they grew past EXTENSION_BUFFER_RETAIN_SIZE, so a
+ * single large message doesn't keep its memory around.
  *
- * @param list Pointer to list
+ * @param index RECEIVE_BUFFER or SEND_BUFFER
+ */
+void shrink_extension_buffers(uint8_t index);
+
+/**
+ * Create an empty extension list. The list and its params are released with the arena.
+ *
+ * @param arena Arena of the request being processed
+ * @return Header Extension list
  */
-void free_extension_list(ExtensionList *list);
+ExtensionList *create_extension_list(Arena *arena);
 
 /**
  * Get extension parameters from an extensions list with a key.
@@ -163,10 +238,11 @@ void free_extension_list(ExtensionList *list);
  * @param list List of extension tokens
  * @param key Extension token to get params
  * @param create Determines if an extension token is created if not found.
+ * @param arena Arena new tokens and params are allocated from
  *
  * @returns params
  */
-ExtensionParam *get_extension_params(ExtensionList *list, char *key, bool create);
+ExtensionParam *get_extension_params(ExtensionList *list, char *key, bool create, Arena *arena);
 
 /**
  * Validate each parameters in the client's extension list
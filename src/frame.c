@@ -10,8 +10,12 @@
 
 #include "extension.h"
 #include "handlers.h"
+#ifdef NITROWS_DEFLATE_ONLY
+#include "permessage-deflate.h"
+#endif
 #include "server.h"
 #include "utf8.h"
+#include "workers.h"
 
 int8_t extract_header_data(Client *client, uint8_t buf[], int size) {
   int8_t header_read = 0;
@@ -54,7 +58,7 @@ bool get_frame_type(Client *client, uint8_t byte) {
   bool rsv2 = (byte & 32) >> 5;
   bool rsv3 = (byte & 16) >> 4;
   bool valid_rsv_bits = true;
-  if (client->indices_count == 0) {
+  if (!uses_extensions(client)) {
     valid_rsv_bits = are_rsv_bits_valid(rsv1, rsv2, rsv3);
   }
 
@@ -208,6 +212,10 @@ void unmask(Client *client, uint8_t buf[], int size) {
  */
 void handle_close_frame(Client *client, uint8_t *data) {
   uint64_t payload_size = client->control_frame.payload_size;
+  // The client is answering our close frame, which completes the close handshake
+  if (client->status == CLOSING) {
+    return;
+  }
   if (payload_size == 0) {
     send_close_status(client, NORMAL);
     return;
@@ -304,12 +312,12 @@ int8_t handle_control_frame(Client *client, uint8_t buf[], int size) {
   }
 
   if (frame->type == PING) {
-    bool is_sent = send_pong_frame(client, data, frame->payload_size);
-    if (!is_sent) {
-      return -1;
-    }
+    // Answered once the data is handled. Only the latest ping needs a pong.
+    memcpy(client->pong_payload, data, frame->payload_size);
+    client->pong_payload_size = frame->payload_size;
+    client->is_pong_due = true;
   } else if (frame->type == PONG) {
-    printf("Received pong frame");
+    handle_pong(client, data, frame->payload_size);
   }
   // Reset all info
   frame->filled_size = 0;
@@ -323,6 +331,94 @@ int8_t handle_control_frame(Client *client, uint8_t buf[], int size) {
   return read;
 }
 
+/**
+ * Run a complete message through the client's extensions. Each extension reads the message from the data frame and
+ * either leaves it alone, changes it in place or writes it to one of the receive buffers. On return, data and length
+ * point to the processed message. If the last extension handed the message to the chunk handler, was_streamed is set
+ * and there's nothing left to deliver.
+ *
+ * @returns EXTENSION_FAILED if an extension rejected the message, EXTENSION_UNCHANGED if none of them changed it and
+ * EXTENSION_WRITTEN otherwise.
+ */
+#ifdef NITROWS_DEFLATE_ONLY
+ExtensionResult __run_extensions(Client *client, uint8_t **data, uint64_t *length, bool *was_streamed) {
+  Frame *frame = &client->data_frame;
+  NitrowsHandler *handler = get_handlers();
+  ExtensionBuffer *output = get_extension_buffer(RECEIVE_BUFFER);
+  ExtensionResult result;
+
+  // permessage-deflate is the only extension a client can have.
+  uint8_t *buffer = frame->buffer;
+  uint64_t filled_size = frame->filled_size;
+  frame->buffer = *data;
+  frame->filled_size = *length;
+  if (handler->handle_message_chunk != NULL) {
+    *was_streamed = true;
+    result = pmd_stream_data(client->socketfd, frame, deliver_message_chunk) ? EXTENSION_UNCHANGED : EXTENSION_FAILED;
+  } else {
+    output->length = 0;
+    result = pmd_process_data(client->socketfd, frame, output);
+    if (result == EXTENSION_WRITTEN) {
+      *data = output->data;
+      *length = output->length;
+    }
+  }
+  frame->buffer = buffer;
+  frame->filled_size = filled_size;
+  return result;
+}
+#else
+ExtensionResult __run_extensions(Client *client, uint8_t **data, uint64_t *length, bool *was_streamed) {
+  Frame *frame = &client->data_frame;
+  NitrowsHandler *handler = get_handlers();
+  Extension *extension = NULL;
+  ExtensionBuffer *output = NULL;
+  ExtensionResult result;
+  ExtensionResult outcome = EXTENSION_UNCHANGED;
+  uint8_t next_buffer = RECEIVE_BUFFER;
+
+  // Extensions read the message from the frame, so the frame points to it while they run.
+  uint8_t *buffer = frame->buffer;
+  uint64_t filled_size = frame->filled_size;
+  frame->buffer = *data;
+  frame->filled_size = *length;
+  for (uint8_t i = 0; i < client->indices_count; i++) {
+    extension = get_extension(client->extension_indices[i]);
+    if (extension == NULL) {
+      continue;
+    }
+    // The last extension can hand its output to the chunk handler directly.
+    if (handler->handle_message_chunk != NULL && extension->stream_data != NULL && i == client->indices_count - 1) {
+      *was_streamed = true;
+      result = extension->stream_data(client->socketfd, frame, deliver_message_chunk) ? EXTENSION_UNCHANGED
+                                                                                       : EXTENSION_FAILED;
+    } else {
+      output = get_extension_buffer(next_buffer);
+      output->length = 0;
+      result = extension->process_data(client->socketfd, frame, output);
+    }
+    if (result == EXTENSION_FAILED) {
+      outcome = EXTENSION_FAILED;
+      break;
+    }
+    if (result == EXTENSION_WRITTEN) {
+      // The next extension reads this output, so it writes to the other buffer of the pair.
+      frame->buffer = output->data;
+      frame->filled_size = output->length;
+      next_buffer = (next_buffer == RECEIVE_BUFFER) ? RECEIVE_BUFFER + 1 : RECEIVE_BUFFER;
+    }
+    if (result != EXTENSION_UNCHANGED) {
+      outcome = EXTENSION_WRITTEN;
+    }
+  }
+  *data = frame->buffer;
+  *length = frame->filled_size;
+  frame->buffer = buffer;
+  frame->filled_size = filled_size;
+  return outcome;
+}
+#endif
+
 int64_t handle_data_frame(Client *client, uint8_t buf[], int size) {
   int64_t read = 0;
   Frame *frame = &client->data_frame;
@@ -386,68 +482,30 @@ int64_t handle_data_frame(Client *client, uint8_t buf[], int size) {
   }
 
   if (frame->is_final) {
-    bool is_valid = false;
-    bool was_written = false;
-    if (frame->type == TEXT && client->indices_count == 0) {
-      if (data == buf) {
-        is_valid = validate_utf8((char *)data, frame->payload_size);
-      } else {
-        is_valid = validate_utf8((char *)frame->buffer, frame->filled_size);
-      }
-      if (!is_valid) {
-        send_close_status(client, INVALID_ENCODING);
+    bool was_streamed = false;
+    ExtensionResult result = EXTENSION_UNCHANGED;
+    uint64_t length = (data == buf) ? frame->payload_size : frame->filled_size;
+    if (uses_extensions(client)) {
+      result = __run_extensions(client, &data, &length, &was_streamed);
+      if (result == EXTENSION_FAILED) {
+        send_close_status(client, (frame->close_code != 0) ? frame->close_code : INVALID_EXTENSION);
+        frame->close_code = 0;
         return -1;
       }
-    } else if (client->indices_count > 0) {
-      uint8_t *output = NULL;
-      uint64_t output_length = 0;
-      Extension *extension = NULL;
-      if (data == buf) {
-        frame->buffer = data;
-        frame->buffer_size = frame->payload_size;
-        frame->filled_size = frame->payload_size;
-      }
-      for (uint8_t i = 0; i < client->indices_count; i++) {
-        extension = get_extension(client->extension_indices[i]);
-        if (extension == NULL) {
-          continue;
-        }
-        is_valid = extension->process_data(client->socketfd, frame, &output, &output_length);
-        if (!is_valid) {
-          if (data == buf) {
-            frame->buffer = NULL;
-          }
-          send_close_status(client, INVALID_EXTENSION);
-          return -1;
-        }
-        if (output_length > 0) {
-          if (frame->buffer != buf && frame->buffer != NULL) {
-            free(frame->buffer);
-          }
-          was_written = true;
-          frame->buffer = output;
-          frame->payload_size = output_length;
-          frame->buffer_size = output_length;
-          frame->filled_size = output_length;
-          output = NULL;
-          output_length = 0;
-        }
-      }
     }
-    if (was_written) {
-      data = frame->buffer;
+
+    // Extensions validate the text they produce, so only untouched text is validated here.
+    if (frame->type == TEXT && result == EXTENSION_UNCHANGED && !was_streamed &&
+        !validate_utf8((char *)data, length)) {
+      send_close_status(client, INVALID_ENCODING);
+      return -1;
     }
 
-    uint64_t length;
-    NitrowsHandler *handler = get_handlers();
-    if (frame->buffer_size == 0) {
-      length = frame->payload_size;
-    } else {
-      length = frame->filled_size;
+    if (!was_streamed) {
+      deliver_message(client, data, length);
     }
-    handler->handle_message(client->socketfd, data, length);
-    if (client->status == CLOSING) {
-      return -1;
+    if (uses_extensions(client)) {
+      shrink_extension_buffers(RECEIVE_BUFFER);
     }
   } else {
     // Reset client struct without freeing buffer because this is a part of other frames.
@@ -468,7 +526,7 @@ int64_t handle_data_frame(Client *client, uint8_t buf[], int size) {
   frame->payload_size = 0;
   frame->type = INVALID;
   frame->current_fragment_offset = 0;
-  if (frame->buffer_size > 0 && data != buf) {
+  if (frame->buffer != NULL) {
     frame->buffer_size = 0;
     frame->filled_size = 0;
     free(frame->buffer);
@@ -494,7 +552,11 @@ void send_close_frame(Client *client, uint8_t *message, uint8_t size) {
   memcpy(frame, &first_byte, 1);
   memcpy(frame + 1, &payload_size, 1);
   memcpy(frame + 2, message, size);
-  send_frame(client, frame, size + 2);
+  // Nothing is sent after the close frame, so the pings in the data being handled and the pending messages are
+  // dropped
+  client->is_pong_due = false;
+  free_pending_messages(client);
+  send_control_frame(client, frame, size + 2);
 }
 
 bool send_pong_frame(Client *client, uint8_t *message, uint8_t size) {
@@ -505,7 +567,19 @@ bool send_pong_frame(Client *client, uint8_t *message, uint8_t size) {
   memcpy(frame, &first_byte, 1);
   memcpy(frame + 1, &payload_size, 1);
   memcpy(frame + 2, message, size);
-  return send_frame(client, frame, size + 2);
+  return send_control_frame(client, frame, size + 2);
+}
+
+bool send_due_pong(Client *client) {
+  if (!client->is_pong_due) {
+    return true;
+  }
+  client->is_pong_due = false;
+  // Nothing is sent after our close frame
+  if (client->status != CONNECTED) {
+    return true;
+  }
+  return send_pong_frame(client, client->pong_payload, client->pong_payload_size);
 }
 
 bool send_ping_frame(Client *client, uint8_t *message, uint8_t size) {
@@ -516,40 +590,83 @@ bool send_ping_frame(Client *client, uint8_t *message, uint8_t size) {
   frame[0] = first_byte;
   frame[1] = payload_size;
   memcpy(frame + 2, message, size);
-  return send_frame(client, frame, size + 2);
+  return send_control_frame(client, frame, size + 2);
 }
 
-bool send_data_frame(int socketfd, uint8_t *message, uint64_t size) {
-  Client *client = get_client(socketfd);
-  uint8_t payload_size = 0;
-  uint8_t size_length = 0;
-  uint8_t first_byte = 128;
-  uint8_t *final_frame = NULL;
-  uint64_t output_size = 0;
-  Frame *frame = &client->data_frame;
-  Extension *extension;
+/**
+ * Run a message that is about to be sent through the client's extensions. On return, message and size point to the
+ * data to send, which might live in one of the send buffers, and the output frame holds the rsv bits to send it with.
+ *
+ * @returns EXTENSION_FAILED if an extension failed, EXTENSION_UNCHANGED if none of them changed the message and
+ * EXTENSION_WRITTEN otherwise.
+ */
+#ifdef NITROWS_DEFLATE_ONLY
+ExtensionResult __generate_extension_data(Client *client, uint8_t **message, uint64_t *size) {
+  Frame *output_frame = &client->output_frame;
+  ExtensionBuffer *output = get_extension_buffer(SEND_BUFFER);
+  output->length = 0;
+  // permessage-deflate is the only extension a client can have.
+  ExtensionResult result = pmd_generate_response(client->socketfd, *message, *size, output, output_frame);
+  if (result == EXTENSION_WRITTEN) {
+    *message = output->data;
+    *size = output->length;
+  }
+  return result;
+}
+#else
+ExtensionResult __generate_extension_data(Client *client, uint8_t **message, uint64_t *size) {
+  Frame *output_frame = &client->output_frame;
+  Extension *extension = NULL;
+  ExtensionBuffer *output = NULL;
+  ExtensionResult result;
+  ExtensionResult outcome = EXTENSION_UNCHANGED;
+  uint8_t next_buffer = SEND_BUFFER;
   for (uint8_t i = 0; i < client->indices_count; i++) {
     extension = get_extension(client->extension_indices[i]);
     if (extension == NULL) {
       continue;
     }
-    output_size = extension->generate_data(client->socketfd, message, size, &client->output_frame);
-    if (output_size > 0) {
-      if (i > 0) {
-        free(message);
-      }
-      message = client->output_frame.buffer;
-      size = output_size;
+    output = get_extension_buffer(next_buffer);
+    output->length = 0;
+    result = extension->generate_data(client->socketfd, *message, *size, output, output_frame);
+    if (result == EXTENSION_FAILED) {
+      return EXTENSION_FAILED;
     }
-    if (output_size == 0 && size > 0) {
-      send_close_status(client, INVALID_EXTENSION);
-      return -1;
+    if (result == EXTENSION_WRITTEN) {
+      // The next extension reads this output, so it writes to the other buffer of the pair.
+      *message = output->data;
+      *size = output->length;
+      next_buffer = (next_buffer == SEND_BUFFER) ? SEND_BUFFER + 1 : SEND_BUFFER;
+      outcome = EXTENSION_WRITTEN;
     }
-    first_byte |= (client->output_frame.rsv1 << 6);
-    first_byte |= (client->output_frame.rsv2 << 5);
-    first_byte |= (client->output_frame.rsv3 << 4);
   }
-  first_byte |= frame->type;
+  return outcome;
+}
+#endif
+
+/**
+ * Frame a message, run it through the client's extensions and send it or add it to the send buffer.
+ *
+ * @returns false if an extension failed or the send failed, else true
+ */
+bool __write_data_frame(Client *client, uint8_t *message, uint64_t size, Opcode type) {
+  uint8_t payload_size = 0;
+  uint8_t size_length = 0;
+  uint8_t first_byte = 128;
+  uint8_t *final_frame = NULL;
+  Frame *output_frame = &client->output_frame;
+  output_frame->rsv1 = false;
+  output_frame->rsv2 = false;
+  output_frame->rsv3 = false;
+  if (uses_extensions(client) && !__generate_extension_data(client, &message, &size)) {
+    send_close_status(client, INVALID_EXTENSION);
+    wait_for_close(client);
+    return false;
+  }
+  first_byte |= (output_frame->rsv1 << 6);
+  first_byte |= (output_frame->rsv2 << 5);
+  first_byte |= (output_frame->rsv3 << 4);
+  first_byte |= type;
   if (size <= (MAX_PAYLOAD_VALUE - 2)) {
     payload_size |= (MAX_PAYLOAD_VALUE & size);
   } else if (size <= UINT16_MAX) {
@@ -572,17 +689,234 @@ bool send_data_frame(int socketfd, uint8_t *message, uint64_t size) {
   memcpy(final_frame + size_length + 2, message, size);
   bool is_sent = send_frame(client, final_frame, size + size_length + 2);
   free(final_frame);
-  if (client->indices_count > 0 && client->output_frame.buffer != NULL) {
-    free(client->output_frame.buffer);
-    client->output_frame.buffer_size = 0;
-    client->output_frame.payload_size = 0;
-    client->output_frame.rsv1 = false;
-    client->output_frame.buffer = NULL;
+  if (uses_extensions(client)) {
+    shrink_extension_buffers(SEND_BUFFER);
   }
   return is_sent;
 }
 
+/**
+ * Get the bucket of a client's index a message key goes in. Keys are often small sequential numbers, so they're
+ * multiplied by a large odd constant to spread them over the buckets.
+ */
+uint32_t __get_pending_bucket(Client *client, uint64_t key) {
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (client->pending_index_size - 1);
+}
+
+/**
+ * Find the message with a key pending for a client.
+ *
+ * @returns message. NULL if none has the key.
+ */
+PendingMessage *__find_pending_message(Client *client, uint64_t key) {
+  if (client->pending_index == NULL) {
+    return NULL;
+  }
+  PendingMessage *pending = client->pending_index[__get_pending_bucket(client, key)];
+  while (pending != NULL && pending->key != key) {
+    pending = pending->next_in_bucket;
+  }
+  return pending;
+}
+
+/**
+ * Add a pending message with a key to its client's index, growing the index if it's full. An index that can't grow
+ * keeps working with longer buckets.
+ *
+ * @returns false if the index can't be allocated, else true
+ */
+bool __index_pending_message(Client *client, PendingMessage *pending) {
+  if (client->pending_keyed_count >= client->pending_index_size) {
+    uint32_t old_size = client->pending_index_size;
+    PendingMessage **old_index = client->pending_index;
+    uint32_t size = (old_size == 0) ? PENDING_INDEX_SIZE : old_size * 2;
+    PendingMessage **index = (PendingMessage **)calloc(size, sizeof(PendingMessage *));
+    if (index == NULL && old_index == NULL) {
+      perror("calloc");
+      return false;
+    }
+    if (index != NULL) {
+      client->pending_index = index;
+      client->pending_index_size = size;
+      PendingMessage *moved = NULL;
+      for (uint32_t i = 0; i < old_size; i++) {
+        while (old_index[i] != NULL) {
+          moved = old_index[i];
+          old_index[i] = moved->next_in_bucket;
+          uint32_t bucket = __get_pending_bucket(client, moved->key);
+          moved->next_in_bucket = index[bucket];
+          index[bucket] = moved;
+        }
+      }
+      free(old_index);
+    }
+  }
+  uint32_t bucket = __get_pending_bucket(client, pending->key);
+  pending->next_in_bucket = client->pending_index[bucket];
+  client->pending_index[bucket] = pending;
+  client->pending_keyed_count++;
+  return true;
+}
+
+/**
+ * Take a message off its client's index and pending bytes, once it's off the pending list.
+ */
+void __remove_pending_message(Client *client, PendingMessage *pending) {
+  if (pending->key != 0) {
+    PendingMessage **link = &client->pending_index[__get_pending_bucket(client, pending->key)];
+    while (*link != pending) {
+      link = &(*link)->next_in_bucket;
+    }
+    *link = pending->next_in_bucket;
+    client->pending_keyed_count--;
+  }
+  client->pending_bytes -= pending->length;
+}
+
+/**
+ * Drop the pending messages of a client that expired, so they stop counting against its watermarks. The list is only
+ * walked once the earliest expiry has passed, so each walk drops at least one message unless that one was replaced.
+ */
+void __drop_expired_messages(Client *client, uint64_t now) {
+  if (client->pending_expiry == 0 || client->pending_expiry > now) {
+    return;
+  }
+  PendingMessage *previous = NULL;
+  PendingMessage *pending = client->pending_head;
+  PendingMessage *next = NULL;
+  client->pending_expiry = 0;
+  while (pending != NULL) {
+    next = pending->next;
+    if (pending->expires_at != 0 && pending->expires_at <= now) {
+      if (previous == NULL) {
+        client->pending_head = next;
+      } else {
+        previous->next = next;
+      }
+      if (client->pending_tail == pending) {
+        client->pending_tail = previous;
+      }
+      __remove_pending_message(client, pending);
+      free(pending->data);
+      free(pending);
+    } else {
+      if (pending->expires_at != 0 && (client->pending_expiry == 0 || pending->expires_at < client->pending_expiry)) {
+        client->pending_expiry = pending->expires_at;
+      }
+      previous = pending;
+    }
+    pending = next;
+  }
+}
+
+/**
+ * Add a message behind the ones pending for a client, or replace the pending message with the same key.
+ */
+Send_status __queue_pending_message(Client *client, uint64_t key, uint64_t expires_at, uint8_t *message, uint64_t size,
+                                    Opcode type) {
+  __drop_expired_messages(client, get_time_ms());
+  PendingMessage *pending = (key == 0) ? NULL : __find_pending_message(client, key);
+  // A replacement doesn't make the queue deeper, so only new messages count against the watermark
+  if (pending == NULL && is_over_high_watermark(client, size)) {
+    return SEND_WOULD_EXCEED;
+  }
+  uint8_t *data = (uint8_t *)malloc(size > 0 ? size : 1);
+  if (data == NULL) {
+    perror("malloc");
+    return SEND_FAILED;
+  }
+  memcpy(data, message, size);
+  if (pending == NULL) {
+    pending = (PendingMessage *)calloc(1, sizeof(PendingMessage));
+    if (pending == NULL) {
+      perror("calloc");
+      free(data);
+      return SEND_FAILED;
+    }
+    pending->key = key;
+    if (key != 0 && !__index_pending_message(client, pending)) {
+      free(pending);
+      free(data);
+      return SEND_FAILED;
+    }
+    if (client->pending_tail == NULL) {
+      client->pending_head = pending;
+    } else {
+      client->pending_tail->next = pending;
+    }
+    client->pending_tail = pending;
+  } else {
+    client->pending_bytes -= pending->length;
+    free(pending->data);
+  }
+  if (expires_at != 0 && (client->pending_expiry == 0 || expires_at < client->pending_expiry)) {
+    client->pending_expiry = expires_at;
+  }
+  pending->expires_at = expires_at;
+  pending->type = type;
+  pending->length = size;
+  pending->data = data;
+  client->pending_bytes += size;
+  return SEND_OK;
+}
+
+Send_status send_conflated_data_frame(int socketfd, uint64_t key, uint64_t expires_at, uint8_t *message, uint64_t size,
+                                      Opcode type) {
+  Client *client = get_client(socketfd);
+  if (client == NULL || client->status != CONNECTED) {
+    return SEND_FAILED;
+  }
+  // A message that can be replaced or expire waits while the send buffer is in use, since that's when a newer one can
+  // still take its place. Any message behind pending ones waits too, so messages stay in order.
+  if (client->pending_head != NULL || ((key != 0 || expires_at != 0) && client->send_buffer != NULL)) {
+    return __queue_pending_message(client, key, expires_at, message, size, type);
+  }
+  // Checked before extensions run. A compressor with context takeover can't take back a message it already
+  // compressed, so the client couldn't inflate what follows.
+  if (is_over_high_watermark(client, size)) {
+    return SEND_WOULD_EXCEED;
+  }
+  return __write_data_frame(client, message, size, type) ? SEND_OK : SEND_FAILED;
+}
+
+Send_status send_data_frame(int socketfd, uint8_t *message, uint64_t size, Opcode type) {
+  return send_conflated_data_frame(socketfd, 0, 0, message, size, type);
+}
+
+bool flush_pending_messages(Client *client) {
+  PendingMessage *pending = NULL;
+  bool is_flushed = false;
+  bool is_written = true;
+  uint64_t now = get_time_ms();
+  // Messages are framed one at a time, only once the previous one went to the socket in full. The rest stay pending,
+  // where they can still be replaced or expire.
+  while (client->pending_head != NULL && client->send_buffer == NULL && client->status == CONNECTED && is_written) {
+    pending = client->pending_head;
+    client->pending_head = pending->next;
+    if (client->pending_head == NULL) {
+      client->pending_tail = NULL;
+    }
+    __remove_pending_message(client, pending);
+    if (pending->expires_at == 0 || pending->expires_at > now) {
+      is_written = __write_data_frame(client, pending->data, pending->length, pending->type);
+    }
+    is_flushed = true;
+    free(pending->data);
+    free(pending);
+  }
+  // Nothing more is sent to a client that's closing. The index goes with the last message, so an idle client doesn't
+  // keep one the size of its longest backlog.
+  if (client->status != CONNECTED || client->pending_head == NULL) {
+    free_pending_messages(client);
+  }
+  return is_flushed;
+}
+
 void start_closing(int socketfd) {
   Client *client = get_client(socketfd);
-  client->status = CLOSING;
+  if (client == NULL || client->status != CONNECTED) {
+    return;
+  }
+  send_close_status(client, NORMAL);
+  wait_for_close(client);
 }
\ No newline at end of file
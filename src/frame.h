@@ -104,7 +104,7 @@ int16_t get_reply_code(uint16_t status_code);
 void send_close_status(Client *client, Status_code code);
 
 /**
- * Send close frame
+ * Send close frame. It goes out ahead of the messages queued for the client, which are dropped.
  *
  * @param client Connected client
  * @param message Close message
@@ -123,6 +123,16 @@ void send_close_frame(Client *client, uint8_t *message, uint8_t size);
  */
 bool send_pong_frame(Client *client, uint8_t *message, uint8_t size);
 
+/**
+ * Answer the latest ping in the data just handled, if there was one. Pings that came before it in the same data aren't
+ * answered, as the spec allows.
+ *
+ * @param client Connected client
+ *
+ * @returns false if the pong couldn't be sent, else true
+ */
+bool send_due_pong(Client *client);
+
 /**
  * Send ping frame
  *
@@ -135,22 +145,50 @@ bool send_pong_frame(Client *client, uint8_t *message, uint8_t size);
 bool send_ping_frame(Client *client, uint8_t *message, uint8_t size);
 
 /**
- * Send data frame
+ * Send data frame. It waits behind the messages pending for the client, if there are any.
  *
  * @param socketfd Socket for the client receiving the message.
  * @param message Data message
  * @param size Size of the message
+ * @param type TEXT or BINARY
  *
- * @returns true if successful, else false
+ * @returns SEND_OK if the frame was sent or buffered, SEND_WOULD_EXCEED if the client's send buffer is over the high
+ * watermark, else SEND_FAILED
  */
-bool send_data_frame(int socketfd, uint8_t *message, uint64_t size);
+Send_status send_data_frame(int socketfd, uint8_t *message, uint64_t size, Opcode type);
 
 /**
- * Start closing client containing whose socket is set to @param socket.
+ * Send a data frame that can be conflated. While the client's send buffer is in use, the message waits unframed and a
+ * newer message with the same key replaces it in place. It's dropped if it's still waiting once it expires.
  *
  * @param socketfd Socket for the client receiving the message.
+ * @param key Messages with the same key replace each other while they wait. 0 is never replaced.
+ * @param expires_at get_time_ms time the message is dropped at if it hasn't been sent. 0 never expires.
+ * @param message Data message
+ * @param size Size of the message
+ * @param type TEXT or BINARY
  *
- * @returns true if successful, else false
+ * @returns SEND_OK if the frame was sent, buffered or left waiting, SEND_WOULD_EXCEED if the client's send buffer is
+ * over the high watermark, else SEND_FAILED
+ */
+Send_status send_conflated_data_frame(int socketfd, uint64_t key, uint64_t expires_at, uint8_t *message, uint64_t size,
+                                      Opcode type);
+
+/**
+ * Send the messages waiting behind a client's send buffer once it's empty. They're framed one at a time for as long as
+ * the socket takes them in full, and expired ones are dropped. A client that's closing has them freed instead.
+ *
+ * @param client Connected client
+ *
+ * @returns true if any message was taken off the queue, else false
+ */
+bool flush_pending_messages(Client *client);
+
+/**
+ * Start closing client containing whose socket is set to @param socket. A close frame is sent and the connection is
+ * closed once the client answers it or the close timeout expires.
+ *
+ * @param socketfd Socket for the client receiving the message.
  */
 void start_closing(int socketfd);
 #endif
\ No newline at end of file
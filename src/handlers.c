@@ -1,7 +1,17 @@
 #include "handlers.h"
 
-void set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t)) {
+void set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t, void *)) {
   nitrows_handler.handle_message = handle_message;
 }
 
+void set_message_chunk_handler(void (*handle_message_chunk)(int, uint8_t *, uint64_t, bool, void *)) {
+  nitrows_handler.handle_message_chunk = handle_message_chunk;
+}
+
+void set_open_handler(void (*handle_open)(int)) { nitrows_handler.handle_open = handle_open; }
+
+void set_close_handler(void (*handle_close)(int, void *)) { nitrows_handler.handle_close = handle_close; }
+
+void set_writable_handler(void (*handle_writable)(int, void *)) { nitrows_handler.handle_writable = handle_writable; }
+
 NitrowsHandler *get_handlers() { return &nitrows_handler; }
\ No newline at end of file
@@ -7,12 +7,32 @@
 typedef struct NitrowsHandler NitrowsHandler;
 
 struct NitrowsHandler {
-  void (*handle_message)(int, uint8_t *, uint64_t);
+  void (*handle_message)(int, uint8_t *, uint64_t, void *);
+
+  // Optional. Receives a message in chunks, the last chunk has its final flag set. Takes precedence over
+  // handle_message.
+  void (*handle_message_chunk)(int, uint8_t *, uint64_t, bool, void *);
+
+  // Optional. Run once a client completes its handshake, before it has user data, and once it's closed, with the user
+  // data it had.
+  void (*handle_open)(int);
+  void (*handle_close)(int, void *);
+
+  // Optional. Run once a client that had a message refused for the high watermark drained to the low watermark.
+  void (*handle_writable)(int, void *);
 };
 
 static NitrowsHandler nitrows_handler;
 
-void set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t));
+void set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t, void *));
+
+void set_message_chunk_handler(void (*handle_message_chunk)(int, uint8_t *, uint64_t, bool, void *));
+
+void set_open_handler(void (*handle_open)(int));
+
+void set_close_handler(void (*handle_close)(int, void *));
+
+void set_writable_handler(void (*handle_writable)(int, void *));
 
 NitrowsHandler *get_handlers();
 #endif
\ No newline at end of file
@@ -0,0 +1,248 @@
+#include "handshake.h"
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAS_SHA_EXTENSIONS_PATH
+#endif
+
+#include "base64.h"
+#include "defs.h"
+#include "extension.h"
+
+static const char response_prefix[] =
+    "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+static const char subprotocol_prefix[] = "\r\nSec-WebSocket-Protocol: ";
+static const char extension_prefix[] = "\r\nSec-Websocket-Extensions: ";
+
+#ifdef HAS_SHA_EXTENSIONS_PATH
+bool __has_sha_extensions() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  // SHA is bit 29 of EBX. The path also needs SSSE3 and SSE4.1, which every CPU with SHA has.
+  return (ebx & (1 << 29)) != 0;
+}
+
+// Four rounds of SHA-1 on the message words in msg. The round function changes every 20 rounds.
+#define SHA1_ROUNDS(e, next_e, msg, function) \
+  e = _mm_sha1nexte_epu32(e, msg);            \
+  next_e = abcd;                              \
+  abcd = _mm_sha1rnds4_epu32(abcd, e, function)
+
+/**
+ * Run the SHA-1 compression function on 64 byte blocks with the SHA extensions. Every group of four rounds also
+ * computes the message words needed three groups later.
+ */
+__attribute__((target("sha,sse4.1,ssse3"))) void __sha1_blocks_sha_extensions(uint32_t state[], const uint8_t data[],
+                                                                            uint8_t block_count) {
+  const __m128i shuffle_mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+  __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+  __m128i e1, abcd_save, e0_save;
+  __m128i msg0, msg1, msg2, msg3;
+
+  for (uint8_t i = 0; i < block_count; i++, data += SHA1_BLOCK_SIZE) {
+    abcd_save = abcd;
+    e0_save = e0;
+    msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), shuffle_mask);
+    msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), shuffle_mask);
+    msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), shuffle_mask);
+    msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), shuffle_mask);
+
+    // Rounds 0-19
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    SHA1_ROUNDS(e1, e0, msg1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    SHA1_ROUNDS(e0, e1, msg2, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    SHA1_ROUNDS(e1, e0, msg3, 0);
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    SHA1_ROUNDS(e0, e1, msg0, 0);
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    // Rounds 20-39
+    SHA1_ROUNDS(e1, e0, msg1, 1);
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    SHA1_ROUNDS(e0, e1, msg2, 1);
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    SHA1_ROUNDS(e1, e0, msg3, 1);
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    SHA1_ROUNDS(e0, e1, msg0, 1);
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    SHA1_ROUNDS(e1, e0, msg1, 1);
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    // Rounds 40-59
+    SHA1_ROUNDS(e0, e1, msg2, 2);
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    SHA1_ROUNDS(e1, e0, msg3, 2);
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    SHA1_ROUNDS(e0, e1, msg0, 2);
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    SHA1_ROUNDS(e1, e0, msg1, 2);
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    SHA1_ROUNDS(e0, e1, msg2, 2);
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    // Rounds 60-79
+    SHA1_ROUNDS(e1, e0, msg3, 3);
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    SHA1_ROUNDS(e0, e1, msg0, 3);
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    SHA1_ROUNDS(e1, e0, msg1, 3);
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    SHA1_ROUNDS(e0, e1, msg2, 3);
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    SHA1_ROUNDS(e1, e0, msg3, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+
+/**
+ * SHA-1 of the 60 byte accept message with the SHA extensions.
+ *
+ * @param message Key followed by the GUID
+ * @param digest Buffer for the 20 byte digest
+ */
+void __sha1_accept_message(const uint8_t message[], uint8_t digest[]) {
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  uint8_t blocks[SHA1_BLOCK_SIZE * 2] = {0};
+  memcpy(blocks, message, ACCEPT_MESSAGE_LENGTH);
+  // Padding is a single 1 bit followed by zeros, and the message length in bits at the end of the last block.
+  blocks[ACCEPT_MESSAGE_LENGTH] = 0x80;
+  blocks[SHA1_BLOCK_SIZE * 2 - 2] = (ACCEPT_MESSAGE_LENGTH * 8) >> 8;
+  blocks[SHA1_BLOCK_SIZE * 2 - 1] = (ACCEPT_MESSAGE_LENGTH * 8) & 0xFF;
+  __sha1_blocks_sha_extensions(state, blocks, 2);
+  for (uint8_t i = 0; i < 5; i++) {
+    digest[i * 4] = state[i] >> 24;
+    digest[i * 4 + 1] = state[i] >> 16;
+    digest[i * 4 + 2] = state[i] >> 8;
+    digest[i * 4 + 3] = state[i];
+  }
+}
+#endif
+
+/**
+ * Encode a SHA-1 digest with base64. 20 bytes are six full groups of 3 bytes, and a group of 2 bytes padded with a
+ * single '='.
+ *
+ * @param digest 20 byte digest
+ * @param encoded Buffer for the 28 encoded characters
+ */
+void __base64_encode_digest(const uint8_t digest[], char encoded[]) {
+  uint32_t triple;
+  for (uint8_t i = 0; i < 6; i++) {
+    triple = (digest[i * 3] << 16) | (digest[i * 3 + 1] << 8) | digest[i * 3 + 2];
+    encoded[i * 4] = encoding_table[(triple >> 18) & 0x3F];
+    encoded[i * 4 + 1] = encoding_table[(triple >> 12) & 0x3F];
+    encoded[i * 4 + 2] = encoding_table[(triple >> 6) & 0x3F];
+    encoded[i * 4 + 3] = encoding_table[triple & 0x3F];
+  }
+  triple = (digest[18] << 16) | (digest[19] << 8);
+  encoded[24] = encoding_table[(triple >> 18) & 0x3F];
+  encoded[25] = encoding_table[(triple >> 12) & 0x3F];
+  encoded[26] = encoding_table[(triple >> 6) & 0x3F];
+  encoded[27] = '=';
+}
+
+void compute_accept_key(const uint8_t key[], char accept[]) {
+  uint8_t message[ACCEPT_MESSAGE_LENGTH];
+  uint8_t digest[SHA1_DIGEST_LENGTH];
+  memcpy(message, key, ACCEPT_MESSAGE_LENGTH - (sizeof(GUID) - 1));
+  memcpy(message + ACCEPT_MESSAGE_LENGTH - (sizeof(GUID) - 1), GUID, sizeof(GUID) - 1);
+#ifdef HAS_SHA_EXTENSIONS_PATH
+  if (sha_extensions_supported == -1) {
+    sha_extensions_supported = __has_sha_extensions();
+  }
+  if (sha_extensions_supported) {
+    __sha1_accept_message(message, digest);
+    __base64_encode_digest(digest, accept);
+    return;
+  }
+#endif
+  if (sha1_context == NULL) {
+    sha1_context = EVP_MD_CTX_new();
+  }
+  EVP_DigestInit_ex(sha1_context, EVP_sha1(), NULL);
+  EVP_DigestUpdate(sha1_context, message, ACCEPT_MESSAGE_LENGTH);
+  EVP_DigestFinal_ex(sha1_context, digest, NULL);
+  __base64_encode_digest(digest, accept);
+}
+
+uint16_t build_upgrade_response(int socketfd, char response[], const uint8_t key[], char subprotocol[],
+                                int subprotocol_len, uint8_t extension_indices[], uint8_t indices_count) {
+  uint16_t length = sizeof(response_prefix) - 1;
+  uint16_t ext_response_length;
+  char ext_response[EXTENSION_RESPONSE_SIZE];
+  memcpy(response, response_prefix, length);
+  compute_accept_key(key, response + length);
+  length += ACCEPT_KEY_LENGTH;
+
+  // Every header is preceded by the end of the line before it
+  if (subprotocol_len > 0) {
+    memcpy(response + length, subprotocol_prefix, sizeof(subprotocol_prefix) - 1);
+    length += sizeof(subprotocol_prefix) - 1;
+    memcpy(response + length, subprotocol, subprotocol_len);
+    length += subprotocol_len;
+  }
+  if (indices_count > 0) {
+    Extension *extension;
+    for (uint8_t i = 0; i < indices_count; i++) {
+      extension = get_extension(extension_indices[i]);
+      if (extension == NULL) {
+        continue;
+      }
+      ext_response_length = extension->respond_to_offer(socketfd, ext_response);
+      if (ext_response_length >= EXTENSION_RESPONSE_SIZE ||
+          length + sizeof(extension_prefix) - 1 + ext_response_length + 4 > HANDSHAKE_RESPONSE_SIZE) {
+        continue;
+      }
+      memcpy(response + length, extension_prefix, sizeof(extension_prefix) - 1);
+      length += sizeof(extension_prefix) - 1;
+      memcpy(response + length, ext_response, ext_response_length);
+      length += ext_response_length;
+    }
+  }
+  memcpy(response + length, "\r\n\r\n", 4);
+  return length + 4;
+}
@@ -0,0 +1,56 @@
+/**
+ * Websocket opening handshake response. The response is assembled from precomputed pieces and the accept key is
+ * computed with the fastest SHA-1 available on the machine, since a server can face a storm of handshakes when many
+ * clients reconnect at once.
+ */
+#ifndef NITROWS_SRC_HANDSHAKE_H
+#define NITROWS_SRC_HANDSHAKE_H
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HANDSHAKE_RESPONSE_SIZE 4096
+#define EXTENSION_RESPONSE_SIZE 512
+#define ACCEPT_KEY_LENGTH 28
+#define SHA1_DIGEST_LENGTH 20
+
+/**
+ * The key sent by the client and the GUID make up a 60 byte message, which SHA-1 pads to two 64 byte blocks. Only the
+ * first 24 bytes change from one handshake to the next.
+ */
+#define SHA1_BLOCK_SIZE 64
+#define ACCEPT_MESSAGE_LENGTH 60
+
+// Whether the CPU has the SHA extensions. -1 until it has been checked.
+static int8_t sha_extensions_supported = -1;
+
+// Digest context reused by every handshake when the SHA extensions aren't available. Setting it up is a large part of
+// the cost of hashing such a short message.
+static EVP_MD_CTX *sha1_context;
+
+/**
+ * Compute the Sec-WebSocket-Accept value of a Sec-WebSocket-Key.
+ *
+ * @param key The 24 character Sec-WebSocket-Key value
+ * @param accept Buffer for the 28 character accept value. It isn't null terminated.
+ */
+void compute_accept_key(const uint8_t key[], char accept[]);
+
+/**
+ * Build the response to a valid upgrade request.
+ *
+ * @param socketfd Client socket descriptor
+ * @param response Buffer of HANDSHAKE_RESPONSE_SIZE bytes for the response
+ * @param key The 24 character Sec-WebSocket-Key value
+ * @param subprotocol Chosen subprotocol. Can be empty
+ * @param subprotocol_len Subprotocol string length. 0 if subprotocol is empty
+ * @param extension_indices Array of extension index needed by the client
+ * @param indices_count Length of the index array
+ *
+ * @returns length of the response
+ */
+uint16_t build_upgrade_response(int socketfd, char response[], const uint8_t key[], char subprotocol[],
+                                int subprotocol_len, uint8_t extension_indices[], uint8_t indices_count);
+
+#endif
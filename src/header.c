@@ -5,85 +5,205 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "server.h"
 
-void add_request(int socketfd, char buffer[], int buffer_len) {
-  // We are going to use socketfd as the hashtable key
-  int index = socketfd % INCOMPLETE_REQUEST_TABLE_SIZE;
-  IncompleteRequest *incomplete_request = (IncompleteRequest *)malloc(sizeof(IncompleteRequest));
-  incomplete_request->buffer_size = buffer_len;
-  incomplete_request->socketfd = socketfd;
-  memcpy(incomplete_request->buffer, buffer, buffer_len);
+/**
+ * Take a buffer from a pool, or allocate one if the pool is empty.
+ *
+ * @param pool Pool index. 0 for chunks, 1 for full size buffers
+ *
+ * @return buffer. NULL if it can't be allocated
+ */
+char *__get_request_buffer(int pool) {
+  RequestBuffer *buffer = request_buffer_pools[pool];
+  if (buffer == NULL) {
+    return (char *)malloc(pool == 0 ? REQUEST_CHUNK_SIZE : REQUEST_BUFFER_SIZE);
+  }
+  request_buffer_pools[pool] = buffer->next;
+  request_buffer_pool_sizes[pool]--;
+  return (char *)buffer;
+}
 
-  incomplete_request->next = incomplete_request_table[index];
-  incomplete_request_table[index] = incomplete_request;
+/**
+ * Return a buffer to its pool. It is freed if the pool is full.
+ *
+ * @param buffer Buffer to return
+ * @param capacity Size of buffer
+ */
+void __put_request_buffer(char *buffer, uint16_t capacity) {
+  int pool = capacity == REQUEST_CHUNK_SIZE ? 0 : 1;
+  if (request_buffer_pool_sizes[pool] == REQUEST_POOL_LIMIT) {
+    free(buffer);
+    return;
+  }
+  RequestBuffer *free_buffer = (RequestBuffer *)buffer;
+  free_buffer->next = request_buffer_pools[pool];
+  request_buffer_pools[pool] = free_buffer;
+  request_buffer_pool_sizes[pool]++;
 }
 
-IncompleteRequest *get_request(int socketfd) {
-  // We get the index of the incomplete header struct using the socket descriptor as
-  // key. We then search the linked list to get the incomplete_request containing
-  // the client.
-  int index = socketfd % INCOMPLETE_REQUEST_TABLE_SIZE;
-  IncompleteRequest *incomplete_request = incomplete_request_table[index];
-  while (incomplete_request != NULL) {
-    if (incomplete_request->socketfd == socketfd) {
-      break;
+/**
+ * Get the slot of a socket descriptor.
+ *
+ * @param socketfd socket descriptor
+ * @param create Whether the chunk holding the slot is allocated if it doesn't exist yet
+ *
+ * @return slot. NULL if it doesn't exist and either create is false or memory can't be allocated
+ */
+IncompleteRequest *__get_request_slot(int socketfd, bool create) {
+  if (socketfd < 0) {
+    return NULL;
+  }
+  int chunk = socketfd / REQUEST_SLOTS_PER_CHUNK;
+  if (chunk >= incomplete_request_chunk_count) {
+    if (!create) {
+      return NULL;
+    }
+    IncompleteRequest **chunks =
+        (IncompleteRequest **)realloc(incomplete_request_chunks, (chunk + 1) * sizeof(IncompleteRequest *));
+    if (chunks == NULL) {
+      return NULL;
+    }
+    memset(chunks + incomplete_request_chunk_count, 0,
+           (chunk + 1 - incomplete_request_chunk_count) * sizeof(IncompleteRequest *));
+    incomplete_request_chunks = chunks;
+    incomplete_request_chunk_count = chunk + 1;
+  }
+  if (incomplete_request_chunks[chunk] == NULL) {
+    if (!create) {
+      return NULL;
+    }
+    incomplete_request_chunks[chunk] = (IncompleteRequest *)calloc(REQUEST_SLOTS_PER_CHUNK, sizeof(IncompleteRequest));
+    if (incomplete_request_chunks[chunk] == NULL) {
+      return NULL;
     }
-    incomplete_request = incomplete_request->next;
   }
-  return incomplete_request;
+  IncompleteRequest *request = &incomplete_request_chunks[chunk][socketfd % REQUEST_SLOTS_PER_CHUNK];
+  request->socketfd = socketfd;
+  return request;
 }
 
-void delete_request(IncompleteRequest *request) {
-  int index = request->socketfd % INCOMPLETE_REQUEST_TABLE_SIZE;
+bool add_request(int socketfd, char buffer[], int buffer_len) {
+  IncompleteRequest *request = __get_request_slot(socketfd, true);
+  if (request == NULL) {
+    return false;
+  }
+  int size = request->buffer_size + buffer_len;
+  if (size > REQUEST_BUFFER_SIZE) {
+    return false;
+  }
 
-  IncompleteRequest *prev = incomplete_request_table[index];
-  IncompleteRequest *current = NULL;
-  // Nothing is found in table. That will be strange, but we want to be robust
-  if (prev == NULL) {
-    free(request);
-    return;
+  if (size > request->capacity) {
+    // Start with a chunk and move to a full size buffer once the request outgrows it
+    int pool = size <= REQUEST_CHUNK_SIZE ? 0 : 1;
+    char *new_buffer = __get_request_buffer(pool);
+    if (new_buffer == NULL) {
+      return false;
+    }
+    if (request->capacity != 0) {
+      memcpy(new_buffer, request->buffer, request->buffer_size);
+      __put_request_buffer(request->buffer, request->capacity);
+    }
+    request->buffer = new_buffer;
+    request->capacity = pool == 0 ? REQUEST_CHUNK_SIZE : REQUEST_BUFFER_SIZE;
   }
 
-  // If incomplete request is at the beginning of the list. Set beginning of list to the next incomplete request. Free
-  // incomplete request
-  if (prev->socketfd == request->socketfd) {
-    current = prev;
-    incomplete_request_table[index] = current->next;
-    free(current);
-    return;
+  memcpy(request->buffer + request->buffer_size, buffer, buffer_len);
+  request->buffer_size = size;
+  return true;
+}
+
+IncompleteRequest *get_request(int socketfd) {
+  IncompleteRequest *request = __get_request_slot(socketfd, false);
+  if (request == NULL || request->capacity == 0) {
+    return NULL;
   }
+  return request;
+}
 
-  // Search for client in list
-  current = prev->next;
-  while (current != NULL) {
-    if (current->socketfd == request->socketfd) {
-      prev->next = current->next;
-      break;
-    }
-    prev = current;
-    current = current->next;
+void delete_request(IncompleteRequest *request) {
+  if (request->capacity != 0) {
+    __put_request_buffer(request->buffer, request->capacity);
   }
+  request->buffer = NULL;
+  request->buffer_size = 0;
+  request->capacity = 0;
+}
 
-  if (current != NULL) {
-    free(current);
+/**
+ * Close a connection that didn't complete its handshake in time.
+ */
+void __handshake_timeout(Timer *timer, void *data) {
+  IncompleteRequest *request = (IncompleteRequest *)data;
+  if (request->capacity != 0) {
+    delete_request(request);
+  }
+  close_connection(request->socketfd);
+}
+
+void start_handshake_timer(int socketfd) {
+  uint32_t timeout = get_timeouts()->handshake;
+  if (timeout == 0) {
+    return;
+  }
+  IncompleteRequest *request = __get_request_slot(socketfd, true);
+  if (request != NULL) {
+    start_timer(&request->timer, timeout, __handshake_timeout, request);
   }
 }
 
-int16_t move_to_next_line(char *start) {
+void stop_handshake_timer(int socketfd) {
+  IncompleteRequest *request = __get_request_slot(socketfd, false);
+  if (request != NULL) {
+    stop_timer(&request->timer);
+  }
+}
+
+char *find_delimiter(char *start, char *end, char first, char second) {
   char *p = start;
-  // Look for carriage return
-  while (*p != '\r') {
-    p++;
+#ifdef __SSE2__
+  // Compare 16 bytes at a time and use the mask of matching bytes to find the first delimiter.
+  __m128i first_vector = _mm_set1_epi8(first);
+  __m128i second_vector = _mm_set1_epi8(second);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, first_vector), _mm_cmpeq_epi8(chunk, second_vector)));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
   }
-  // Invalid header if it isn't followed by '\n'
-  if (*p != '\r' && *(p + 1) != '\n') {
-    return -1;
+#else
+  if (first == second) {
+    p = memchr(start, first, end - start);
+    return p == NULL ? end : p;
   }
+#endif
+  while (p < end && *p != first && *p != second) {
+    p++;
+  }
+  return p;
+}
 
-  p += 2;  // Move to the next line
-  return p - start;
+int32_t find_request_end(char buf[], uint16_t length, uint16_t from) {
+  // The blank line might have started in the data checked by an earlier call.
+  char *p = buf + (from > 3 ? from - 3 : 0);
+  char *end = buf + length;
+  while ((p = find_delimiter(p, end, '\r', '\r')) < end) {
+    if (end - p < 4) {
+      return -1;
+    }
+    if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+      return p + 4 - buf;
+    }
+    p++;
+  }
+  return -1;
 }
 
 int16_t is_upgrade_header_valid(int socketfd, char *start) {
@@ -181,7 +301,7 @@ int16_t get_subprotocols(int socketfd, char *start, char subprotocol[], int *sub
   return p - start;
 }
 
-bool __add_extension_param_key(char c, ExtensionParam **current_params_addr) {
+bool __add_extension_param_key(char c, ExtensionParam **current_params_addr, Arena *arena) {
   ExtensionParam *prev_params;
   ExtensionParam *current_params = *current_params_addr;
   if (current_params == NULL) {
@@ -192,8 +312,11 @@ bool __add_extension_param_key(char c, ExtensionParam **current_params_addr) {
     current_params = current_params->next;
   }
   if (current_params == NULL) {
-    prev_params->next = calloc(1, sizeof(ExtensionParam));
+    prev_params->next = (ExtensionParam *)arena_alloc(arena, sizeof(ExtensionParam));
     current_params = prev_params->next;
+    if (current_params == NULL) {
+      return false;
+    }
   }
   if (c == ',') {
     current_params->value_type = BOOL;
@@ -204,11 +327,15 @@ bool __add_extension_param_key(char c, ExtensionParam **current_params_addr) {
   return true;
 }
 
-void __add_extension_param_value(char c, char *start, int8_t length, ExtensionParam **current_params_addr) {
+bool __add_extension_param_value(char c, char *start, int8_t length, ExtensionParam **current_params_addr,
+                                  Arena *arena) {
   ExtensionParam *current_params = *current_params_addr;
   if (current_params->value_type != EMPTY) {
-    current_params->next = calloc(1, sizeof(ExtensionParam));
+    current_params->next = (ExtensionParam *)arena_alloc(arena, sizeof(ExtensionParam));
     current_params = current_params->next;
+    if (current_params == NULL) {
+      return false;
+    }
   }
   bool is_digit = true;
   int i;
@@ -245,9 +372,10 @@ void __add_extension_param_value(char c, char *start, int8_t length, ExtensionPa
     current_params->is_last = true;
   }
   *current_params_addr = current_params;
+  return true;
 }
 
-int16_t parse_extensions(int socketfd, char *line, ExtensionList *extension_list) {
+int16_t parse_extensions(int socketfd, char *line, ExtensionList *extension_list, Arena *arena) {
   bool IN_QUOTE = false;
   char *p = line;
   char error[] = "Invalid Sec-Websocket-Extensions header";
@@ -286,8 +414,8 @@ int16_t parse_extensions(int socketfd, char *line, ExtensionList *extension_list
       key[length] = '\0';
       start = NULL;
       length = 0;
-      current_params = get_extension_params(extension_list, key, true);
-      success = __add_extension_param_key(c, &current_params);
+      current_params = get_extension_params(extension_list, key, true, arena);
+      success = __add_extension_param_key(c, &current_params, arena);
       if (!success) {
         send_error_response(socketfd, CLIENT_ERROR, error);
         return -1;
@@ -300,7 +428,11 @@ int16_t parse_extensions(int socketfd, char *line, ExtensionList *extension_list
         send_error_response(socketfd, CLIENT_ERROR, error);
         return -1;
       }
-      __add_extension_param_value(c, start, length, &current_params);
+      success = __add_extension_param_value(c, start, length, &current_params, arena);
+      if (!success) {
+        send_error_response(socketfd, CLIENT_ERROR, error);
+        return -1;
+      }
       if (c == ',') {
         has_extension = false;
       }
@@ -319,105 +451,122 @@ int16_t parse_extensions(int socketfd, char *line, ExtensionList *extension_list
   if (!has_extension) {
     strncpy(key, start, length);
     key[length] = '\0';
-    current_params = get_extension_params(extension_list, key, true);
-    success = __add_extension_param_key(',', &current_params);
+    current_params = get_extension_params(extension_list, key, true, arena);
+    success = __add_extension_param_key(',', &current_params, arena);
     if (!success) {
       send_error_response(socketfd, CLIENT_ERROR, error);
       return -1;
     }
   } else {
-    __add_extension_param_value(',', start, length, &current_params);
+    success = __add_extension_param_value(',', start, length, &current_params, arena);
+    if (!success) {
+      send_error_response(socketfd, CLIENT_ERROR, error);
+      return -1;
+    }
   }
   return p - line;
 }
 
+/**
+ * Header names are dispatched through a perfect hash on their length. The length of each name is distinct, so a name
+ * can only be the header at its length's slot, which is then confirmed with a single comparison. Slots hold the index
+ * of the header plus one, so that empty slots are 0.
+ */
+static const char *header_names[] = {"Host",
+                                     "Upgrade",
+                                     "Sec-Websocket-Key",
+                                     "Sec-Websocket-Version",
+                                     "Sec-Websocket-Protocol",
+                                     "Sec-Websocket-Extensions"};
+static const int8_t header_slots[32] = {[4] = 1, [7] = 2, [17] = 3, [21] = 4, [22] = 5, [24] = 6};
+
+int8_t __get_header_index(char *name, size_t length) {
+  if (length >= 32) {
+    return -1;
+  }
+  int8_t index = header_slots[length] - 1;
+  if (index == -1 || strncasecmp(name, header_names[index], length) != 0) {
+    return -1;
+  }
+  return index;
+}
+
 bool validate_headers(char buf[], uint16_t request_length, int socketfd, uint8_t key[], char subprotocol[],
                       int subprotocol_len, uint8_t **extension_indices, uint8_t *indices_count) {
-  char *p = NULL;
+  char *p = buf;
+  char *end = buf + request_length;
+  char *line_end = NULL;
+  char *colon = NULL;
   int8_t index = 0;
   int16_t progress = 0;
-  char *headers[] = {"Host:",
-                     "Upgrade:",
-                     "Sec-Websocket-Key:",
-                     "Sec-Websocket-Version:",
-                     "Sec-Websocket-Protocol:",
-                     "Sec-Websocket-Extensions:"};
-  int8_t header_count = 6;
   bool required_headers_present[] = {false, false, false, false};  // Store required headers check status here.
   bool is_valid = true;
-  p = buf;
-  ExtensionList *list = get_extension_list(socketfd);
-  while (*p != '\0' && (p - buf) < request_length && *p != '\r' && *p != '\n') {
-    for (index = 0; index < header_count && (p - buf) < request_length; index++) {
-      progress = 0;
-      if (index < 4 && required_headers_present[index]) {
-        continue;
-      }
-      if (strncasecmp(p, headers[index], strlen(headers[index])) != 0) {
-        continue;
-      }
-      p += strlen(headers[index]);  // Bypass header
-      if (index == 0) {
-        // Host is available. That's all we want to know
-        required_headers_present[index] = true;
-      } else if (index == 1) {
-        progress = is_upgrade_header_valid(socketfd, p);
-        if (progress == -1) {
-          is_valid = false;
-          break;
-        }
-        required_headers_present[index] = true;
-      } else if (index == 2) {
-        progress = get_sec_websocket_key_value(socketfd, p, key);
-        if (progress == -1) {
-          is_valid = false;
-          break;
-        }
-        required_headers_present[index] = true;
-      } else if (index == 3) {
-        progress = is_version_header_valid(socketfd, p);
-        if (progress == -1) {
-          is_valid = false;
-          break;
-        }
-        required_headers_present[index] = true;
-      } else if (index == 4) {
-        progress = get_subprotocols(socketfd, p, subprotocol, &subprotocol_len);
-        if (progress == -1) {
-          is_valid = false;
-          break;
-        }
-      } else {
-        progress = parse_extensions(socketfd, p, list);
-        if (progress == -1) {
-          is_valid = false;
-          break;
-        }
-        break;
-      }
-      p += progress;
+  // Everything allocated while parsing the request comes from this arena and is released at once at the end.
+  uint8_t arena_buffer[HANDSHAKE_ARENA_SIZE];
+  Arena arena;
+  arena_init(&arena, arena_buffer, sizeof(arena_buffer));
+  ExtensionList *list = create_extension_list(&arena);
+  // Each line is scanned once for its end and once for the colon ending the header name. The first line is the
+  // request line, which has no header name to dispatch.
+  line_end = find_delimiter(p, end, '\r', '\r');
+  while (line_end < end - 1 && line_end[1] == '\n') {
+    p = line_end + 2;
+    line_end = find_delimiter(p, end, '\r', '\r');
+    if (line_end == p) {
+      // Blank line ending the headers
+      break;
+    }
+    colon = find_delimiter(p, line_end, ':', ':');
+    if (colon == line_end) {
+      continue;
     }
-    if (!is_valid) {
-      delete_extension_list(socketfd);
-      return is_valid;
+    index = __get_header_index(p, colon - p);
+    if (index == -1 || (index < 4 && required_headers_present[index])) {
+      continue;
+    }
+    p = colon + 1;  // Bypass header
+    if (index == 0) {
+      // Host is available. That's all we want to know
+      progress = 0;
+    } else if (index == 1) {
+      progress = is_upgrade_header_valid(socketfd, p);
+    } else if (index == 2) {
+      progress = get_sec_websocket_key_value(socketfd, p, key);
+    } else if (index == 3) {
+      progress = is_version_header_valid(socketfd, p);
+    } else if (index == 4) {
+      progress = get_subprotocols(socketfd, p, subprotocol, &subprotocol_len);
+    } else {
+      progress = parse_extensions(socketfd, p, list, &arena);
     }
-    progress = move_to_next_line(p);
     if (progress == -1) {
-      return false;
+      is_valid = false;
+      break;
+    }
+    if (index < 4) {
+      required_headers_present[index] = true;
     }
-    p += progress;
+  }
+  if (!is_valid) {
+    arena_release(&arena);
+    return is_valid;
+  }
+  if (line_end >= end - 1 || line_end[1] != '\n') {
+    arena_release(&arena);
+    return false;
   }
 
   // If none of the required headers isn't there, return false
   index = 0;
   while (index < 4) {
     if (!required_headers_present[index]) {
+      arena_release(&arena);
       return false;
     }
     index++;
   }
 
   is_valid = validate_extension_list(socketfd, list, extension_indices, indices_count);
-  delete_extension_list(socketfd);
+  arena_release(&arena);
   return is_valid;
 }
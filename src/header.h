@@ -7,39 +7,60 @@
 #include <stdbool.h>
 
 #include "extension.h"
+#include "timer.h"
 
 #define CLIENT_ERROR 400
-#define INCOMPLETE_REQUEST_TABLE_SIZE 128
+#define HANDSHAKE_ARENA_SIZE 1024
+#define REQUEST_CHUNK_SIZE 1024    // Buffer size for a partial request. Enough for most complete requests.
+#define REQUEST_BUFFER_SIZE 4096   // Buffer size a partial request grows to when it outgrows a chunk
+#define REQUEST_POOL_LIMIT 64      // Free buffers of each size kept for reuse
+#define REQUEST_SLOTS_PER_CHUNK 256
 
 /**
- * Due to unreliable network, a client might not send a complete connection request header. This table is used to store
- * an incomplete connection request. This should be used sparingly based on the standard header size and current network
- * conditions. The struct and struct table is defined below
+ * Due to unreliable network, a client might not send a complete connection request header. The part received so far is
+ * stored until the rest arrives. Slow clients do this a lot, e.g on mobile networks, so the stored parts live in slots
+ * indexed by socket descriptor and their buffers come from pools. A buffer starts small and only grows to
+ * REQUEST_BUFFER_SIZE if the request needs it. The slot also holds the deadline for completing the handshake, so it's
+ * allocated in fixed chunks that never move.
  */
 typedef struct incomplete_request IncompleteRequest;
 
 struct incomplete_request {
   int socketfd;
-  uint16_t buffer_size;
-  char buffer[4096];
-  IncompleteRequest *next;
+  uint16_t buffer_size;  // Size of the data in buffer
+  uint16_t capacity;     // Size of buffer. 0 if the slot is unused
+  char *buffer;
+  Timer timer;  // Closes the connection if the handshake isn't done in time
 };
 
-// Table containing all the currently processed connection requests.
-static IncompleteRequest *incomplete_request_table[INCOMPLETE_REQUEST_TABLE_SIZE];
+// Chunks of REQUEST_SLOTS_PER_CHUNK slots of the requests currently being received, indexed by socket descriptor
+static IncompleteRequest **incomplete_request_chunks;
+static int incomplete_request_chunk_count;
+
+typedef struct request_buffer RequestBuffer;
+
+// A free buffer in a pool. The link is stored in the buffer itself.
+struct request_buffer {
+  RequestBuffer *next;
+};
+
+// Pools of free buffers. The first one holds REQUEST_CHUNK_SIZE buffers and the second REQUEST_BUFFER_SIZE buffers.
+static RequestBuffer *request_buffer_pools[2];
+static uint8_t request_buffer_pool_sizes[2];
 
 /**
- * Initialize an incomplete request structure and add it to the table
+ * Append data to the stored part of a request. The request is added if nothing has been stored for the socket.
+ *
+ * @param socketfd socket descriptor
+ * @param buffer Data to append
+ * @param buffer_len Length of data
  *
- * @param socketfd  socket descriptor
- * @param buffer Buffer containing the response
- * @param buffer_len Length of buffer
- * @return created client struct
+ * @return false if the request would be larger than REQUEST_BUFFER_SIZE or memory can't be allocated, else true
  */
-void add_request(int socketfd, char buffer[], int buffer_len);
+bool add_request(int socketfd, char buffer[], int buffer_len);
 
 /**
- * Get an incomplete request structure from the table
+ * Get the stored part of a request
  *
  * @param socketfd socket descriptor
  * @return incomplete request struct. Null if not found
@@ -47,20 +68,48 @@ void add_request(int socketfd, char buffer[], int buffer_len);
 IncompleteRequest *get_request(int socketfd);
 
 /**
- * Delete an incomplete request struct from the table
+ * Delete a stored request. Its buffer is returned to the pool.
  *
- * @param client Pointer to incomplete request struct
+ * @param request Pointer to incomplete request struct
  */
 void delete_request(IncompleteRequest *request);
 
 /**
- * Move header to next line and make sure newlines are valid.
+ * Start the deadline for a new connection to complete its handshake. The connection is closed when it expires.
  *
- * @param string header string
+ * @param socketfd socket descriptor
+ */
+void start_handshake_timer(int socketfd);
+
+/**
+ * Stop the handshake deadline of a connection, once it's upgraded or closed.
  *
- * @return Increase in position. -1 if invalid
+ * @param socketfd socket descriptor
+ */
+void stop_handshake_timer(int socketfd);
+
+/**
+ * Find the first occurrence of either delimiter in a buffer. Pass the same character twice to look for one delimiter.
+ *
+ * @param start Start of buffer
+ * @param end End of buffer
+ * @param first First delimiter
+ * @param second Second delimiter
+ *
+ * @return Pointer to the delimiter. `end` if neither delimiter is found
+ */
+char *find_delimiter(char *start, char *end, char first, char second);
+
+/**
+ * Find the end of an upgrade request, the blank line after its headers.
+ *
+ * @param buf Request buffer
+ * @param length Length of data in buffer
+ * @param from Offset from which to start looking. Data before it has been checked by an earlier call.
+ *
+ * @return Length of the request including the blank line. -1 if the request is incomplete
  */
-int16_t move_to_next_line(char *start);
+int32_t find_request_end(char buf[], uint16_t length, uint16_t from);
 
 /**
  * Check the validity of the `Upgrade` header in the opening
@@ -125,10 +174,11 @@ int16_t get_subprotocols(int socketfd, char *start, char subprotocol[], int *sub
  * @param start Pointer to start of header value
  * @param token_list List of extension tokens
  * length
+ * @param arena Arena the tokens and their params are allocated from
  *
  * @return Increase in position. -1 if invalid
  */
-int16_t parse_extensions(int socketfd, char *line, ExtensionList *extension_list);
+int16_t parse_extensions(int socketfd, char *line, ExtensionList *extension_list, Arena *arena);
 
 /**
  * Validate header. Check for the different required and optional headers in
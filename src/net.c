@@ -1,16 +1,87 @@
+#define _GNU_SOURCE  // For accept4
 #include "net.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "defs.h"
 #include "events.h"
+#include "header.h"
+#include "tls.h"
+
+ListenerOptions *get_listener_options() { return &listener_options; }
+
+SocketProfile *get_socket_profile() { return &socket_profile; }
+
+Listeners *get_listeners() { return &listeners; }
+
+bool add_unix_listener(char *path) {
+  struct sockaddr_un addr;
+  // One listener is kept for the TCP port
+  if (strlen(path) >= sizeof(addr.sun_path) || listeners.unix_path_count >= MAX_LISTENERS - 1) {
+    return false;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    return false;
+  }
+  listeners.unix_paths[listeners.unix_path_count++] = copy;
+  return true;
+}
+
+/**
+ * Set the socket buffer sizes of the listener options on a socket.
+ *
+ * @param socketfd socket descriptor
+ */
+void __apply_buffer_sizes(int socketfd) {
+  if (listener_options.receive_buffer_size > 0 &&
+      setsockopt(socketfd, SOL_SOCKET, SO_RCVBUF, &listener_options.receive_buffer_size, sizeof(int)) == -1) {
+    perror("setsockopt: SO_RCVBUF");
+  }
+  if (listener_options.send_buffer_size > 0 &&
+      setsockopt(socketfd, SOL_SOCKET, SO_SNDBUF, &listener_options.send_buffer_size, sizeof(int)) == -1) {
+    perror("setsockopt: SO_SNDBUF");
+  }
+}
+
+/**
+ * Set the listener options on a listener socket before it starts listening. Options the system doesn't support are
+ * skipped, they only make the listener slower, not incorrect.
+ *
+ * @param listener listener socket descriptor
+ * @param is_tcp Whether the listener is a TCP socket. Options that only apply to TCP are skipped otherwise.
+ */
+void __apply_listener_options(int listener, bool is_tcp) {
+  __apply_buffer_sizes(listener);
+  if (!is_tcp) {
+    return;
+  }
+#ifdef TCP_DEFER_ACCEPT
+  if (listener_options.defer_accept > 0 &&
+      setsockopt(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, &listener_options.defer_accept, sizeof(int)) == -1) {
+    perror("setsockopt: TCP_DEFER_ACCEPT");
+  }
+#endif
+#ifdef TCP_FASTOPEN
+  if (listener_options.fastopen_queue > 0 &&
+      setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, &listener_options.fastopen_queue, sizeof(int)) == -1) {
+    perror("setsockopt: TCP_FASTOPEN");
+  }
+#endif
+}
 
 int get_listener_socket() {
   int listener = 0;  // Listener socket descriptor
@@ -42,6 +113,7 @@ int get_listener_socket() {
 
     // Set up SO_REUSEADDR to avoid "address already in use" error message
     setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    __apply_listener_options(listener, true);
 
     if (bind(listener, p->ai_addr, p->ai_addrlen) < 0) {
       close(listener);
@@ -59,14 +131,72 @@ int get_listener_socket() {
     return -1;
   }
 
-  if (listen(listener, LISTEN_BACKLOG) == -1) {
+  if (listen(listener, listener_options.backlog > 0 ? listener_options.backlog : LISTEN_BACKLOG) == -1) {
     perror("listen");
     return -1;
   }
 
+  // Connections are accepted until the backlog is empty, so accept must not block.
+  fcntl(listener, F_SETFL, O_NONBLOCK);
+
   return listener;
 }
 
+int get_unix_listener_socket(char *path) {
+  struct sockaddr_un addr;
+  struct stat info;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Unix socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, strlen(path));
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return -1;
+  }
+  __apply_listener_options(listener, false);
+
+  // A socket file outlives the server that bound it and makes bind fail. Anything else at the path is left alone.
+  if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(path);
+  }
+  if (bind(listener, (struct sockaddr *)&addr, sizeof addr) < 0) {
+    perror("bind");
+    close(listener);
+    return -1;
+  }
+
+  if (listen(listener, listener_options.backlog > 0 ? listener_options.backlog : LISTEN_BACKLOG) == -1) {
+    perror("listen");
+    close(listener);
+    return -1;
+  }
+
+  // Connections are accepted until the backlog is empty, so accept must not block.
+  fcntl(listener, F_SETFL, O_NONBLOCK);
+
+  return listener;
+}
+
+uint8_t create_listeners() {
+  int listener = -1;
+  listeners.socket_count = 0;
+  if (listeners.is_tcp_enabled && (listener = get_listener_socket()) != -1) {
+    listeners.sockets[listeners.socket_count++] = listener;
+  }
+  for (uint8_t i = 0; i < listeners.unix_path_count; i++) {
+    if ((listener = get_unix_listener_socket(listeners.unix_paths[i])) != -1) {
+      listeners.sockets[listeners.socket_count++] = listener;
+    }
+  }
+  return listeners.socket_count;
+}
+
 // Get either IPv4 or IPv6 sockaddr.
 void *get_in_addr(struct sockaddr *sa) {
   // Get IPv4 sockaddr
@@ -77,19 +207,92 @@ void *get_in_addr(struct sockaddr *sa) {
   return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
-void accept_connection(int listener_socket) {
+/**
+ * Accept a connection as a non-blocking socket that isn't inherited by child processes.
+ *
+ * @param listener_socket our own server socket descriptor
+ * @param remote_addr Address of the connected client
+ * @param addrlen Size of remote_addr
+ *
+ * @returns socket descriptor of the connection, -1 on error
+ */
+int __accept_nonblocking(int listener_socket, struct sockaddr_storage *remote_addr, socklen_t *addrlen) {
+#ifdef __linux__
+  return accept4(listener_socket, (struct sockaddr *)remote_addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int newfd = accept(listener_socket, (struct sockaddr *)remote_addr, addrlen);
+  if (newfd != -1) {
+    fcntl(newfd, F_SETFL, O_NONBLOCK);
+    fcntl(newfd, F_SETFD, FD_CLOEXEC);
+  }
+  return newfd;
+#endif
+}
+
+/**
+ * Set the socket profile options on an accepted connection.
+ *
+ * @param socketfd Client socket descriptor
+ */
+void __apply_socket_profile(int socketfd) {
+  int yes = 1;
+  if (socket_profile.no_delay && setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1) {
+    perror("setsockopt: TCP_NODELAY");
+  }
+#ifdef TCP_NOTSENT_LOWAT
+  if (socket_profile.notsent_lowat > 0 &&
+      setsockopt(socketfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &socket_profile.notsent_lowat, sizeof(int)) == -1) {
+    perror("setsockopt: TCP_NOTSENT_LOWAT");
+  }
+#endif
+#ifdef SO_BUSY_POLL
+  if (socket_profile.busy_poll > 0 &&
+      setsockopt(socketfd, SOL_SOCKET, SO_BUSY_POLL, &socket_profile.busy_poll, sizeof(int)) == -1) {
+    perror("setsockopt: SO_BUSY_POLL");
+  }
+#endif
+}
+
+bool accept_connection(int listener_socket) {
   int newfd = 0;
   struct sockaddr_storage remote_addr;
   socklen_t addrlen;
 
   char ip_addr[INET6_ADDRSTRLEN];
 
-  addrlen = sizeof remote_addr;
-  newfd = accept(listener_socket, (struct sockaddr *)&remote_addr, &addrlen);
-  if (newfd == -1) {
-    printf("accept");
+  for (int i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+    addrlen = sizeof remote_addr;
+    newfd = __accept_nonblocking(listener_socket, &remote_addr, &addrlen);
+    if (newfd == -1) {
+      // The connection was reset while in the backlog or a signal interrupted us, try the next one
+      if (errno == ECONNABORTED || errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+      }
+      return false;
+    }
+    // Connections through a unix domain socket come from the same host and have no address or TCP options. They
+    // don't inherit the listener's buffer sizes either.
+    if (remote_addr.ss_family == AF_UNIX) {
+      __apply_buffer_sizes(newfd);
+    } else {
+      __apply_socket_profile(newfd);
+    }
+#ifdef NITROWS_TLS
+    // A unix socket is for a proxy on the same host, which already terminated TLS
+    if (remote_addr.ss_family != AF_UNIX && is_tls_enabled() && !start_tls(newfd)) {
+      close(newfd);
+      continue;
+    }
+#endif
+    add_to_event_loop(newfd);
+    start_handshake_timer(newfd);
+    if (remote_addr.ss_family != AF_UNIX) {
+      printf("New connection from %s\n",
+             inet_ntop(remote_addr.ss_family, get_in_addr((struct sockaddr *)&remote_addr), ip_addr, INET6_ADDRSTRLEN));
+    }
   }
-  add_to_event_loop(newfd);
-  printf("New connection from %s\n",
-         inet_ntop(remote_addr.ss_family, get_in_addr((struct sockaddr *)&remote_addr), ip_addr, INET6_ADDRSTRLEN));
+  return true;
 }
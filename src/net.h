@@ -5,6 +5,107 @@
 #ifndef NITROWS_SRC_NET_H
 #define NITROWS_SRC_NET_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "defs.h"
+
+/**
+ * Options applied to the listener socket when it is created. Options that are 0 are left to the system.
+ */
+typedef struct ListenerOptions ListenerOptions;
+
+struct ListenerOptions {
+  // Length of the queue of connections waiting to be accepted
+  int backlog;
+
+  // Seconds the kernel holds a new connection until its first data arrives, so that we're only woken for connections
+  // that have sent their upgrade request. TCP_DEFER_ACCEPT on Linux only.
+  int defer_accept;
+
+  // Length of the queue of TCP Fast Open connections that haven't been accepted yet. Clients reconnecting with a Fast
+  // Open cookie send their upgrade request in the SYN and save a round trip.
+  int fastopen_queue;
+
+  // SO_RCVBUF and SO_SNDBUF of the listener. Accepted connections inherit them.
+  int receive_buffer_size;
+  int send_buffer_size;
+};
+
+static ListenerOptions listener_options = {LISTEN_BACKLOG, 0, 0, 0, 0};
+
+/**
+ * Options applied to every accepted connection. They favour latency over throughput.
+ */
+typedef struct SocketProfile SocketProfile;
+
+struct SocketProfile {
+  // Disable Nagle's algorithm, so that small frames like pongs aren't held back waiting for the ACK of earlier data.
+  bool no_delay;
+
+  // Most bytes the kernel keeps queued but not yet sent. Writes beyond it fail with EAGAIN and the rest of the data
+  // waits in the client's send buffer until EPOLLOUT, so newer messages aren't stuck behind a deep kernel queue of
+  // stale ones. 0 leaves the system default. TCP_NOTSENT_LOWAT.
+  int notsent_lowat;
+
+  // Microseconds to busy poll the device queue for data on blocking reads before sleeping. 0 disables it.
+  // SO_BUSY_POLL on Linux only.
+  int busy_poll;
+};
+
+static SocketProfile socket_profile = {true, DEFAULT_NOTSENT_LOWAT, 0};
+
+/**
+ * Sockets the server listens on. Connections from any of them are accepted and upgraded the same way.
+ */
+typedef struct Listeners Listeners;
+
+struct Listeners {
+  // Listen on the TCP port PORT
+  bool is_tcp_enabled;
+
+  // Paths of the unix domain sockets to listen on. A reverse proxy on the same host can connect through one and skip
+  // the TCP stack.
+  char *unix_paths[MAX_LISTENERS];
+  uint8_t unix_path_count;
+
+  // Descriptors of the listening sockets once they're created
+  int sockets[MAX_LISTENERS];
+  uint8_t socket_count;
+};
+
+static Listeners listeners = {true};
+
+/**
+ * Get the options accepted connections are set up with.
+ *
+ * @returns socket profile
+ */
+SocketProfile *get_socket_profile();
+
+/**
+ * Get the options the listener socket is created with. Changes only apply to a listener created afterwards.
+ *
+ * @returns listener options
+ */
+ListenerOptions *get_listener_options();
+
+/**
+ * Get the sockets the server listens on.
+ *
+ * @returns listeners
+ */
+Listeners *get_listeners();
+
+/**
+ * Add a unix domain socket for the server to listen on. It's created along with the other listeners.
+ *
+ * @param path Path of the socket. It's copied.
+ *
+ * @returns false if the path is too long or there are already MAX_LISTENERS listeners, else true
+ */
+bool add_unix_listener(char *path);
+
 /**
  * Create and get our server's listener socket descriptor. This descriptor
  * will be what clients connect to.
@@ -14,10 +115,30 @@
 int get_listener_socket();
 
 /**
- * Accept new connection made to the listener socket desc. If successful, we
- * will add the accepted connection socket descriptor to our event loop.
+ * Create a listener socket bound to a unix domain socket path. A socket file left at the path by an earlier run is
+ * replaced.
+ *
+ * @param path Path of the socket
+ *
+ * @returns socket descriptor if successful, otherwise -1.
+ */
+int get_unix_listener_socket(char *path);
+
+/**
+ * Create every listener socket that's enabled. The descriptors are stored in the listeners.
+ *
+ * @returns number of listener sockets created
+ */
+uint8_t create_listeners();
+
+/**
+ * Accept new connections made to the listener socket desc until there are
+ * none left or ACCEPT_BATCH_SIZE of them are accepted. Each accepted
+ * connection socket descriptor is added to our event loop.
  *
  * @param listener_socket our own server socket descriptor
+ *
+ * @returns true if connections might still be waiting to be accepted.
  */
-void accept_connection(int listener_socket);
+bool accept_connection(int listener_socket);
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "nitrows.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -10,29 +11,226 @@
 #include "net.h"
 #include "permessage-deflate.h"
 #include "server.h"
+#include "tls.h"
+#include "workers.h"
 
+#ifndef NITROWS_SPECIALIZED_EXTENSIONS
 void nitrows_register_extension(char *key, bool (*validate_offer)(int, ExtensionParam *),
                                 uint16_t (*respond_to_offer)(int, char *),
-                                bool (*process_data)(int, Frame *, uint8_t **, uint64_t *),
-                                uint64_t (*generate_data)(int, uint8_t *, uint64_t, Frame *), void (*close)(int)) {
-  register_extension(key, validate_offer, respond_to_offer, process_data, generate_data, close);
+                                ExtensionResult (*process_data)(int, Frame *, ExtensionBuffer *),
+                                ExtensionResult (*generate_data)(int, uint8_t *, uint64_t, ExtensionBuffer *, Frame *),
+                                bool (*stream_data)(int, Frame *, void (*)(int, uint8_t *, uint64_t, bool)),
+                                void (*close)(int)) {
+  register_extension(key, validate_offer, respond_to_offer, process_data, generate_data, stream_data, close);
 }
+#endif
 
-void nitrows_set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t)) {
+void nitrows_set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t, void *)) {
   set_message_handler(handle_message);
 }
 
-bool nitrows_send_message(int client_id, uint8_t *message, uint64_t length) {
-  return send_data_frame(client_id, message, length);
+void nitrows_set_message_chunk_handler(void (*handle_message_chunk)(int, uint8_t *, uint64_t, bool, void *)) {
+  set_message_chunk_handler(handle_message_chunk);
 }
 
-void nitrows_close(int client_id) { start_closing(client_id); }
+void nitrows_set_max_inflated_size(uint64_t size) { pmd_set_max_inflated_size(size); }
 
-void nitrows_run() {
-  nitrows_register_extension("permessage-deflate", pmd_validate_offer, pmd_respond, pmd_process_data,
-                             pmd_generate_response, pmd_close);
-  int listener_socket = get_listener_socket();
+void nitrows_set_listen_backlog(int backlog) { get_listener_options()->backlog = backlog; }
+
+void nitrows_set_defer_accept(int timeout) { get_listener_options()->defer_accept = timeout; }
+
+void nitrows_set_fastopen(int queue_length) { get_listener_options()->fastopen_queue = queue_length; }
+
+void nitrows_set_socket_buffer_sizes(int receive_size, int send_size) {
+  ListenerOptions *options = get_listener_options();
+  options->receive_buffer_size = receive_size;
+  options->send_buffer_size = send_size;
+}
+
+void nitrows_set_no_delay(bool enable) { get_socket_profile()->no_delay = enable; }
+
+void nitrows_set_notsent_lowat(int size) { get_socket_profile()->notsent_lowat = size; }
+
+void nitrows_set_busy_poll(int timeout) { get_socket_profile()->busy_poll = timeout; }
+
+void nitrows_set_handshake_timeout(uint32_t timeout) { get_timeouts()->handshake = timeout; }
+
+void nitrows_set_idle_timeout(uint32_t timeout) { get_timeouts()->idle = timeout; }
+
+void nitrows_set_close_timeout(uint32_t timeout) { get_timeouts()->close = timeout; }
+
+void nitrows_set_heartbeat(uint32_t interval, uint8_t max_missed_pongs) {
+  Heartbeat *heartbeat = get_heartbeat();
+  heartbeat->interval = interval;
+  heartbeat->max_missed_pongs = (max_missed_pongs == 0) ? MAX_MISSED_PONGS : max_missed_pongs;
+}
+
+void nitrows_set_open_handler(void (*handle_open)(int)) { set_open_handler(handle_open); }
+
+void nitrows_set_close_handler(void (*handle_close)(int, void *)) { set_close_handler(handle_close); }
+
+void nitrows_set_writable_handler(void (*handle_writable)(int, void *)) { set_writable_handler(handle_writable); }
+
+void nitrows_set_send_watermarks(uint64_t high, uint64_t low) {
+  SendWatermarks *watermarks = get_send_watermarks();
+  watermarks->high = high;
+  watermarks->low = (low < high) ? low : high;
+}
+
+uint64_t nitrows_get_queued_bytes(int client_id) {
+  Client *client = get_client(client_id);
+  return (client == NULL) ? 0 : get_queued_bytes(client);
+}
+
+bool nitrows_set_userdata(int client_id, void *userdata) {
+  Client *client = get_client(client_id);
+  if (client == NULL) {
+    return false;
+  }
+  client->userdata = userdata;
+  return true;
+}
+
+void *nitrows_get_userdata(int client_id) {
+  Client *client = get_client(client_id);
+  return (client == NULL) ? NULL : client->userdata;
+}
+
+uint64_t nitrows_get_client_generation(int client_id) {
+  if (is_worker_thread()) {
+    return get_handled_client_generation(client_id);
+  }
+  Client *client = get_client(client_id);
+  return (client == NULL) ? 0 : client->generation;
+}
+
+int64_t nitrows_get_rtt(int client_id) {
+  Client *client = get_client(client_id);
+  return (client == NULL) ? -1 : client->rtt;
+}
+
+void nitrows_start_timer(Timer *timer, uint64_t timeout, void (*callback)(Timer *, void *), void *data) {
+  start_timer(timer, timeout, callback, data);
+}
+
+void nitrows_stop_timer(Timer *timer) { stop_timer(timer); }
+
+Send_status nitrows_send_message(int client_id, uint8_t *message, uint64_t length) {
+  // A reply has the type of the message being handled
+  Opcode type = get_handled_message_type();
+  // Workers can't touch the clients, so their messages are sent by the event loop
+  if (is_worker_thread()) {
+    uint64_t generation = get_handled_client_generation(client_id);
+    return queue_message(client_id, generation, message, length, type) ? SEND_OK : SEND_FAILED;
+  }
+  return send_data_frame(client_id, message, length, type);
+}
+
+Send_status nitrows_send_conflated_message(int client_id, uint64_t key, uint32_t ttl, uint8_t *message,
+                                           uint64_t length, Opcode type) {
+  uint64_t expires_at = (ttl == 0) ? 0 : get_time_ms() + ttl;
+  if (is_worker_thread()) {
+    uint64_t generation = get_handled_client_generation(client_id);
+    return queue_conflated_message(client_id, generation, key, expires_at, message, length, type) ? SEND_OK
+                                                                                                  : SEND_FAILED;
+  }
+  return send_conflated_data_frame(client_id, key, expires_at, message, length, type);
+}
+
+bool nitrows_queue_message(int client_id, uint64_t generation, uint8_t *message, uint64_t length, Opcode type) {
+  if (generation == 0) {
+    generation = get_handled_client_generation(client_id);
+  }
+  return queue_message(client_id, generation, message, length, type);
+}
+
+int nitrows_broadcast_message(int *client_ids, int count, uint8_t *message, uint64_t length, Opcode type) {
+  int sent = 0;
+  if (is_worker_thread()) {
+    for (int i = 0; i < count; i++) {
+      if (queue_message(client_ids[i], get_handled_client_generation(client_ids[i]), message, length, type)) {
+        sent++;
+      }
+    }
+    return sent;
+  }
+  pmd_begin_shared_message(message, length);
+  for (int i = 0; i < count; i++) {
+    if (send_data_frame(client_ids[i], message, length, type) == SEND_OK) {
+      sent++;
+    }
+  }
+  pmd_end_shared_message();
+  return sent;
+}
+
+void nitrows_close(int client_id) {
+  if (is_worker_thread()) {
+    queue_action(client_id, get_handled_client_generation(client_id), QUEUED_CLOSE);
+  } else {
+    start_closing(client_id);
+  }
+}
+
+bool nitrows_pause_reading(int client_id) {
+  if (is_worker_thread()) {
+    return queue_action(client_id, get_handled_client_generation(client_id), QUEUED_PAUSE_READING);
+  }
+  Client *client = get_client(client_id);
+  if (client == NULL) {
+    return false;
+  }
+  pause_reading(client);
+  return true;
+}
+
+bool nitrows_resume_reading(int client_id) {
+  if (is_worker_thread()) {
+    return queue_action(client_id, get_handled_client_generation(client_id), QUEUED_RESUME_READING);
+  }
+  Client *client = get_client(client_id);
+  return client != NULL && resume_reading(client);
+}
+
+void nitrows_set_worker_threads(int count) { set_worker_count(count); }
+
+#ifdef NITROWS_TLS
+bool nitrows_set_tls(char *certificate_file, char *key_file) { return init_tls(certificate_file, key_file); }
+#endif
+
+bool nitrows_listen_unix(char *path) { return add_unix_listener(path); }
+
+void nitrows_set_tcp_listener(bool enabled) { get_listeners()->is_tcp_enabled = enabled; }
+
+void nitrows_init() {
+#ifndef NITROWS_NO_EXTENSIONS
+  register_extension("permessage-deflate", pmd_validate_offer, pmd_respond, pmd_process_data, pmd_generate_response,
+                     pmd_stream_data, pmd_close);
+#endif
+  Listeners *listeners = get_listeners();
+  if (create_listeners() == 0) {
+    fprintf(stderr, "No socket to listen on\n");
+    exit(1);
+  }
   init_event_loop();
-  add_to_event_loop(listener_socket);
-  run_event_loop(listener_socket, accept_connection, handle_connection);
-}
\ No newline at end of file
+  for (uint8_t i = 0; i < listeners->socket_count; i++) {
+    add_to_event_loop(listeners->sockets[i]);
+  }
+  set_event_handlers(listeners->sockets, listeners->socket_count, accept_connection, handle_connection,
+                     send_queued_messages);
+  init_wakeup();
+  // Messages might have been queued before the loop could be woken up
+  signal_wakeup();
+  start_workers();
+}
+
+int nitrows_get_fd() { return get_event_loop_fd(); }
+
+int nitrows_next_timeout() { return get_event_loop_timeout(); }
+
+int nitrows_step(int timeout) { return step_event_loop(timeout); }
+
+void nitrows_run() {
+  nitrows_init();
+  run_event_loop();
+}
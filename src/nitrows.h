@@ -4,7 +4,9 @@
 #include <stdbool.h>
 
 #include "extension.h"
+#include "timer.h"
 
+#ifndef NITROWS_SPECIALIZED_EXTENSIONS
 /**
  * This function registers Sec-Websocket-Extensions handlers for different points of processing data from accepting
  * connection to responding with data.
@@ -14,38 +16,440 @@
  * @param respond_to_offer: Handler for generating a response to a negotiation
  * offer.
  * @param validate_rsv: Handler for validating a frame's rsv
- * @param process_data: Handler for processing client request.
+ * @param process_data: Handler for processing client request. It can change the data in place or write it to the
+ * scratch buffer it is given, and returns an ExtensionResult saying which one it did, if any.
+ * @param generate_data: Handler for generating data sent to the client. It writes to the scratch buffer it is given
+ * or returns EXTENSION_UNCHANGED.
+ * @param stream_data: Optional handler for processing client request in chunks. Can be NULL.
  * @param close: Handler for closing and releasing resources associated with a
  * client.
  */
 void nitrows_register_extension(char *key, bool (*validate_offer)(int, ExtensionParam *),
                                 uint16_t (*respond_to_offer)(int, char *),
-                                bool (*process_data)(int, Frame *, uint8_t **, uint64_t *),
-                                uint64_t (*generate_data)(int, uint8_t *, uint64_t, Frame *), void (*close)(int));
+                                ExtensionResult (*process_data)(int, Frame *, ExtensionBuffer *),
+                                ExtensionResult (*generate_data)(int, uint8_t *, uint64_t, ExtensionBuffer *, Frame *),
+                                bool (*stream_data)(int, Frame *, void (*)(int, uint8_t *, uint64_t, bool)),
+                                void (*close)(int));
+#endif
 
 /**
  * This function sets up a function for processing a websocket message.
  *
  * @param handle_message: Handler for a websocket message.  This function must accept the following parameters: An
- * integer which is the WebSocket client key, A string which is the message, and an integer which is the message length.
+ * integer which is the WebSocket client key, A string which is the message, an integer which is the message length
+ * and the client's user data.
  */
-void nitrows_set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t));
+void nitrows_set_message_handler(void (*handle_message)(int, uint8_t *, uint64_t, void *));
 
 /**
- * This function sends a websocket message
+ * This function sets up a function for processing a websocket message in chunks. Compressed messages are handed over
+ * as they are inflated, so they never have to be held in memory in full. Once set, it is used instead of the message
+ * handler.
+ *
+ * @param handle_message_chunk: Handler for a websocket message chunk. This function must accept the following
+ * parameters: An integer which is the WebSocket client key, A string which is the chunk, an integer which is the chunk
+ * length, a boolean which is true for the last chunk of the message and the client's user data. The last chunk can be
+ * empty. If a message is rejected midway, its last chunk is never delivered and the connection is closed.
+ */
+void nitrows_set_message_chunk_handler(void (*handle_message_chunk)(int, uint8_t *, uint64_t, bool, void *));
+
+/**
+ * This function sets up a function that runs when a client completes its handshake, before any of its messages are
+ * handled. It always runs on the event loop, so it can set the client's user data and send messages. Optional.
+ *
+ * @param handle_open: Handler that accepts the WebSocket client key.
+ */
+void nitrows_set_open_handler(void (*handle_open)(int));
+
+/**
+ * This function sets up a function that runs once a client that completed its handshake is closed, for whatever
+ * reason. The client is gone by then, so it's the place to free the client's user data. With worker threads it runs
+ * on the client's worker after the client's last message handler. Optional.
+ *
+ * @param handle_close: Handler that accepts the WebSocket client key and the client's user data.
+ */
+void nitrows_set_close_handler(void (*handle_close)(int, void *));
+
+/**
+ * This function sets up a function that runs once a client can be sent messages again. After nitrows_send_message
+ * returned SEND_WOULD_EXCEED for a client, it runs when the client's send buffer drains to the low watermark. With
+ * worker threads it runs on the client's worker. Optional.
+ *
+ * @param handle_writable: Handler that accepts the WebSocket client key and the client's user data.
+ */
+void nitrows_set_writable_handler(void (*handle_writable)(int, void *));
+
+/**
+ * This function sets how much data can wait in the server for a client that reads slowly. Once queuing a message would
+ * take a client's send buffer past the high watermark, messages to it are refused with SEND_WOULD_EXCEED until it
+ * drains to the low watermark and the writable handler runs. A message is never refused when the buffer is empty, so
+ * a single message larger than the high watermark still goes out. Control frames are never refused. Defaults to
+ * SEND_HIGH_WATERMARK and SEND_LOW_WATERMARK.
+ *
+ * @param high: High watermark in bytes. 0 disables the limit.
+ * @param low: Low watermark in bytes. It's capped at the high watermark.
+ */
+void nitrows_set_send_watermarks(uint64_t high, uint64_t low);
+
+/**
+ * This function gets the number of bytes waiting in the server to be sent to a client. It must be called from the
+ * event loop.
+ *
+ * @param client_id: WebSocket client id.
+ *
+ * @returns queued bytes. 0 if the client isn't found.
+ */
+uint64_t nitrows_get_queued_bytes(int client_id);
+
+/**
+ * This function attaches a pointer owned by the application to a client. It's handed to every handler for the client,
+ * which saves looking the client's state up. It must be called from the event loop, usually in the open handler.
+ *
+ * @param client_id: WebSocket client id.
+ * @param userdata: Pointer to attach. nitrows never dereferences it.
+ *
+ * @returns false if the client isn't found, else true
+ */
+bool nitrows_set_userdata(int client_id, void *userdata);
+
+/**
+ * This function gets the pointer attached to a client. It must be called from the event loop.
+ *
+ * @param client_id: WebSocket client id.
+ *
+ * @returns the client's user data. NULL if the client isn't found or has none.
+ */
+void *nitrows_get_userdata(int client_id);
+
+/**
+ * This function gets the generation of a client. Client ids are socket descriptors, which the system reuses as soon as
+ * a client is gone, but a generation is never reused. Threads that keep client ids around pass it to
+ * nitrows_queue_message, so a message for a client that's gone isn't sent to a later client with the same id. It must
+ * be called from the event loop, e.g in the open handler. From a handler running on a worker, only the generation of
+ * the client being handled is known.
+ *
+ * @param client_id: WebSocket client id.
+ *
+ * @returns generation. 0 if the client isn't found.
+ */
+uint64_t nitrows_get_client_generation(int client_id);
+
+/**
+ * This function sets the largest size a compressed message can inflate to. Messages that inflate past it close the
+ * connection with status 1009. Defaults to MAX_PAYLOAD_SIZE.
+ *
+ * @param size: Inflated size limit in bytes
+ */
+void nitrows_set_max_inflated_size(uint64_t size);
+
+/**
+ * This function sets the length of the queue of connections waiting to be accepted. Defaults to LISTEN_BACKLOG. The
+ * system caps it, e.g with net.core.somaxconn on Linux.
+ *
+ * @param backlog: Backlog length
+ */
+void nitrows_set_listen_backlog(int backlog);
+
+/**
+ * This function makes the server only accept connections once they have sent data, so it isn't woken up for
+ * connections that haven't sent their upgrade request yet. Only supported on Linux, ignored elsewhere.
+ *
+ * @param timeout: Seconds to wait for data before the connection is accepted anyway. 0 disables it.
+ */
+void nitrows_set_defer_accept(int timeout);
+
+/**
+ * This function enables TCP Fast Open, so clients reconnecting with a Fast Open cookie can send their upgrade request
+ * along with the SYN. Linux also needs the server bit of net.ipv4.tcp_fastopen set.
+ *
+ * @param queue_length: Number of Fast Open connections that can wait to be accepted. 0 disables it.
+ */
+void nitrows_set_fastopen(int queue_length);
+
+/**
+ * This function sets the socket buffer sizes of the listener, which accepted connections inherit. 0 leaves the system
+ * default.
+ *
+ * @param receive_size: SO_RCVBUF in bytes
+ * @param send_size: SO_SNDBUF in bytes
+ */
+void nitrows_set_socket_buffer_sizes(int receive_size, int send_size);
+
+/**
+ * This function enables or disables TCP_NODELAY on accepted connections. Enabled by default, so small frames are sent
+ * right away instead of waiting for the ACK of earlier data.
+ *
+ * @param enable: Whether TCP_NODELAY is set
+ */
+void nitrows_set_no_delay(bool enable);
+
+/**
+ * This function sets the most bytes the kernel keeps queued but unsent for a connection. Data beyond it waits in the
+ * server until the connection drains, which keeps latency low for new messages when a client reads slowly. Defaults
+ * to DEFAULT_NOTSENT_LOWAT.
+ *
+ * @param size: Size in bytes. 0 leaves the system default.
+ */
+void nitrows_set_notsent_lowat(int size);
+
+/**
+ * This function sets SO_BUSY_POLL on accepted connections. Only supported on Linux, ignored elsewhere.
+ *
+ * @param timeout: Microseconds to busy poll for. 0 disables it.
+ */
+void nitrows_set_busy_poll(int timeout);
+
+/**
+ * This function sets how long a new connection has to complete its handshake before it's closed. Defaults to
+ * HANDSHAKE_TIMEOUT.
+ *
+ * @param timeout: Timeout in milliseconds. 0 disables it.
+ */
+void nitrows_set_handshake_timeout(uint32_t timeout);
+
+/**
+ * This function sets how long a client can go without sending anything before it's closed. Disabled by default.
+ *
+ * @param timeout: Timeout in milliseconds. 0 disables it.
+ */
+void nitrows_set_idle_timeout(uint32_t timeout);
+
+/**
+ * This function sets how long a client has to answer the close frame sent to it before the connection is closed
+ * anyway. Defaults to CLOSE_TIMEOUT.
+ *
+ * @param timeout: Timeout in milliseconds. 0 waits for the answer indefinitely.
+ */
+void nitrows_set_close_timeout(uint32_t timeout);
+
+/**
+ * This function enables a heartbeat. Every client is pinged at an interval, its round trip time is measured from the
+ * pong and it's closed if it leaves too many pings unanswered. Disabled by default.
+ *
+ * @param interval: Milliseconds between pings. 0 disables the heartbeat.
+ * @param max_missed_pongs: Number of pings a client can leave unanswered before it's closed. 0 uses the default,
+ * MAX_MISSED_PONGS.
+ */
+void nitrows_set_heartbeat(uint32_t interval, uint8_t max_missed_pongs);
+
+/**
+ * This function gets the round trip time of a client, measured by the heartbeat.
+ *
+ * @param client_id: WebSocket client id.
+ *
+ * @returns round trip time of the last answered ping in microseconds. -1 if the client isn't found or hasn't answered
+ * a ping yet.
+ */
+int64_t nitrows_get_rtt(int client_id);
+
+/**
+ * This function starts a timer run by the event loop. Starting a running timer restarts it.
+ *
+ * @param timer: Timer to start. It has to be zeroed before it's started the first time and its memory must stay valid
+ * while it's running.
+ * @param timeout: Milliseconds until the timer expires.
+ * @param callback: Function run when the timer expires. It receives the timer and data, and can start the timer
+ * again.
+ * @param data: Passed to the callback.
+ */
+void nitrows_start_timer(Timer *timer, uint64_t timeout, void (*callback)(Timer *, void *), void *data);
+
+/**
+ * This function stops a timer. Nothing happens if it isn't running.
+ *
+ * @param timer: Timer to stop.
+ */
+void nitrows_stop_timer(Timer *timer);
+
+/**
+ * This function sends a websocket message. It can only be called from the event loop, e.g in a message handler. Called
+ * from a handler running on a worker, the message is queued like with nitrows_queue_message. It's sent with the type
+ * of the message being handled, or as binary outside of a message handler.
  *
  * @param client_id: WebSocket Client ID
  * @param message: Message to be sent.
  * @param length: Message Length
+ *
+ * @returns SEND_OK if the message was sent or buffered. SEND_WOULD_EXCEED if it was dropped because the client's send
+ * buffer is over the high watermark, in which case the writable handler runs once it drains. SEND_FAILED if the client
+ * isn't found or the send failed. From a worker, SEND_OK only means the message was queued for the event loop, which
+ * drops it if the client is over the high watermark by then.
  */
-bool nitrows_send_message(int client_id, uint8_t *message, uint64_t length);
+Send_status nitrows_send_message(int client_id, uint8_t *message, uint64_t length);
 
 /**
- * This function closes a websocket connection
+ * This function sends a websocket message that only matters until a newer one replaces it, e.g the latest price of an
+ * instrument. Messages to a client whose send buffer holds data wait instead of being framed right away. A newer
+ * message with the same key replaces a waiting one in place, keeping its position, and a message still waiting once
+ * its TTL runs out is dropped. A slow client gets the latest value per key and its queue stays as deep as the number
+ * of keys. Other messages sent while some wait are queued behind them, so the order is kept. It can be called from the
+ * same places as nitrows_send_message.
+ *
+ * @param client_id: WebSocket Client ID
+ * @param key: Messages with the same key replace each other while they wait. 0 is never replaced.
+ * @param ttl: Milliseconds the message can wait before it's dropped. 0 never drops it.
+ * @param message: Message to be sent.
+ * @param length: Message Length
+ * @param type: TEXT or BINARY
+ *
+ * @returns SEND_OK if the message was sent, buffered or left waiting. SEND_WOULD_EXCEED and SEND_FAILED like
+ * nitrows_send_message. Replacing a waiting message is never refused for the high watermark.
+ */
+Send_status nitrows_send_conflated_message(int client_id, uint64_t key, uint32_t ttl, uint8_t *message,
+                                           uint64_t length, Opcode type);
+
+/**
+ * This function queues a websocket message to be sent by the event loop. Unlike nitrows_send_message, it's safe to
+ * call from any thread. The message is copied, so the caller can reuse its buffer right away. Messages queued by the
+ * same thread are sent in order. They're dropped if the client is gone by the time they're sent.
+ *
+ * @param client_id: WebSocket Client ID
+ * @param generation: Generation of the client from nitrows_get_client_generation. The message is dropped if that
+ * client is gone, even if a new client got its id. 0 sends it to whichever client has the id, or from a handler
+ * running on a worker, to the client being handled if that's the one.
+ * @param message: Message to be sent.
+ * @param length: Message Length
+ * @param type: TEXT or BINARY
+ *
+ * @returns false if the message couldn't be queued, else true
+ */
+bool nitrows_queue_message(int client_id, uint64_t generation, uint8_t *message, uint64_t length, Opcode type);
+
+/**
+ * This function sends the same websocket message to many clients. Clients that negotiated permessage-deflate with
+ * server_no_context_takeover share a single compressed copy of the message, so it's compressed once per window size
+ * instead of once per client.
+ *
+ * @param client_ids: WebSocket Client IDs
+ * @param count: Number of client IDs
+ * @param message: Message to be sent.
+ * @param length: Message Length
+ * @param type: TEXT or BINARY
+ *
+ * @returns number of clients the message was sent to
+ */
+int nitrows_broadcast_message(int *client_ids, int count, uint8_t *message, uint64_t length, Opcode type);
+
+/**
+ * This function closes a websocket connection. Called from a handler running on a worker, the close is queued for the
+ * event loop. The close frame goes out right after the frame being sent, so messages still waiting for a slow client
+ * are dropped.
  *
  * @param client_id: WebSocket client id.
  */
 void nitrows_close(int client_id);
 
+/**
+ * This function stops reading from a client, e.g while whatever its messages go to is saturated. What the client sends
+ * stays in the kernel's socket buffer, and once that's full, TCP flow control stops the client from sending more, so
+ * memory stays bounded. Messages in data that was already read are still handled. Pings aren't answered and a client
+ * that disconnects isn't noticed until it's resumed. The idle timeout and the heartbeat don't run while it's paused, so
+ * it isn't closed for pongs that wait unread, and the heartbeat starts over once it's resumed. Called from a handler
+ * running on a worker, the pause is queued for the event loop, so a few more messages can arrive first.
+ *
+ * @param client_id: WebSocket client id.
+ *
+ * @returns false if the client isn't found or the pause can't be queued, else true
+ */
+bool nitrows_pause_reading(int client_id);
+
+/**
+ * This function reads from a client paused by nitrows_pause_reading again. Data the client sent in the meantime is
+ * read once the event loop is done with the current event, so it's safe to call from any handler.
+ *
+ * @param client_id: WebSocket client id.
+ *
+ * @returns false if the client isn't found or the read can't be queued, else true
+ */
+bool nitrows_resume_reading(int client_id);
+
+/**
+ * This function runs message handlers on a pool of worker threads instead of the event loop, so slow handlers don't
+ * delay other clients. Each client is pinned to one worker, so its messages are handled in order. Handlers running on
+ * workers can call nitrows_send_message, nitrows_send_conflated_message, nitrows_queue_message,
+ * nitrows_broadcast_message, nitrows_close, nitrows_pause_reading, nitrows_resume_reading and
+ * nitrows_get_client_generation, which only knows the client being handled there. Other functions must only be called
+ * from the event loop. Disabled by default.
+ *
+ * @param count: Number of workers. 0 runs handlers on the event loop.
+ */
+void nitrows_set_worker_threads(int count);
+
+#ifdef NITROWS_TLS
+/**
+ * This function makes the server accept TLS connections, so it can be reached over wss:// without a reverse proxy.
+ * Once a handshake completes, OpenSSL hands the session to the kernel (kTLS) when the kernel supports it, and the
+ * connection is served with plain socket calls. Otherwise it stays encrypted by OpenSSL. Only available when nitrows
+ * is built with TLS=1. It must be called before the server starts. OpenSSL's writes can raise SIGPIPE, so it's
+ * ignored from then on unless the application already set a handler for it. It only applies to the TCP port.
+ * Connections through a unix domain socket added with nitrows_listen_unix stay unencrypted.
+ *
+ * @param certificate_file: Path of the PEM certificate chain
+ * @param key_file: Path of the PEM private key
+ *
+ * @returns false if the certificate or key can't be loaded, else true
+ */
+bool nitrows_set_tls(char *certificate_file, char *key_file);
+#endif
+
+/**
+ * This function adds a unix domain socket for the server to listen on, besides the TCP port or instead of it. A
+ * reverse proxy on the same host can connect through it and skip the TCP stack. Its clients are handled like any
+ * other, except they don't use TLS even if nitrows_set_tls enabled it, since the proxy already terminated it. Access
+ * to the socket is controlled by its file permissions. A socket file left at the path by an earlier run is replaced.
+ * It must be called before the server starts.
+ *
+ * @param path: Path of the socket
+ *
+ * @returns false if the path is too long or MAX_LISTENERS - 1 unix sockets were already added, else true
+ */
+bool nitrows_listen_unix(char *path);
+
+/**
+ * This function sets whether the server listens on the TCP port. Enabled by default. It must be called before the
+ * server starts.
+ *
+ * @param enabled: Whether to listen on the TCP port
+ */
+void nitrows_set_tcp_listener(bool enabled);
+
+/**
+ * This function creates the listeners and the event loop without running it, so the loop can be driven by the host
+ * application with nitrows_step. Handlers and settings must be set before it's called. Call either this function or
+ * nitrows_run, not both.
+ */
+void nitrows_init();
+
+/**
+ * This function returns a descriptor that's readable whenever nitrows has sockets ready to be handled. The host
+ * application can add it to its own epoll, kqueue or poll set, level triggered, and call nitrows_step(0) when it's
+ * readable.
+ *
+ * @returns epoll descriptor on Linux and kqueue descriptor on BSD and macOS. -1 where nitrows uses poll, in which
+ * case nitrows_step has to be called with a short timeout instead.
+ */
+int nitrows_get_fd();
+
+/**
+ * This function returns how long the host application can wait before calling nitrows_step even if the descriptor
+ * from nitrows_get_fd isn't readable, so that timeouts, heartbeats and timers run on time.
+ *
+ * @returns milliseconds until nitrows has work to do. 0 if it has some already and -1 if there's none scheduled.
+ */
+int nitrows_next_timeout();
+
+/**
+ * This function runs a single iteration of the event loop. It handles every socket that's ready and runs the timers
+ * that expired. It never waits past nitrows' own next timeout.
+ *
+ * @param timeout: Milliseconds to wait for sockets to be ready at most. 0 doesn't wait and -1 waits until there's work.
+ *
+ * @returns number of ready descriptors handled. -1 on error, with errno set.
+ */
+int nitrows_step(int timeout);
+
+/**
+ * This function creates the listeners and runs the event loop forever.
+ */
 void nitrows_run();
 #endif
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <string.h>
 #include <zlib.h>
 
+#include "utf8.h"
+
 void pmd_add_to_table(PMDClientConfig *config) {
   // We are going to use socketfd as the hashtable key
   int index = config->socketfd % HASHTABLE_SIZE;
@@ -154,11 +156,7 @@ bool pmd_validate_offer(int socketfd, ExtensionParam *param) {
   return acceptable;
 }
 
-uint16_t pmd_respond(int socketfd, char *response) {
-  PMDClientConfig *config = pmd_get_from_table(socketfd);
-  if (config == NULL) {
-    return 0;
-  }
+uint16_t __pmd_format_response(PMDClientConfig *config, char *response) {
   strcpy(response, "permessage-deflate");
   uint16_t length = 18;
   if (config->client_max_window_bits != MAX_WINDOW_BITS) {
@@ -177,96 +175,207 @@ uint16_t pmd_respond(int socketfd, char *response) {
   return length;
 }
 
-bool pmd_process_data(int socketfd, Frame *frame, uint8_t **output, uint64_t *output_length) {
-  if (frame->rsv1 == 0) {
-    return true;
-  }
+uint16_t pmd_respond(int socketfd, char *response) {
   PMDClientConfig *config = pmd_get_from_table(socketfd);
   if (config == NULL) {
-    return false;
+    return 0;
   }
-  int ret;
-  if (config->inflater == NULL) {
-    config->inflater = (z_stream *)malloc(sizeof(z_stream));
-    config->inflater->zalloc = Z_NULL;
-    config->inflater->zfree = Z_NULL;
-    config->inflater->opaque = Z_NULL;
-    config->inflater->avail_in = 0;
-    config->inflater->next_in = Z_NULL;
-    ret = inflateInit2(config->inflater, -config->client_max_window_bits);
-    if (ret != Z_OK) {
-      return false;
-    }
+  if (config->client_max_window_bits < MIN_WINDOW_BITS || config->client_max_window_bits > MAX_WINDOW_BITS ||
+      config->server_max_window_bits < MIN_WINDOW_BITS || config->server_max_window_bits > MAX_WINDOW_BITS) {
+    return __pmd_format_response(config, response);
   }
-  z_stream *inflater = config->inflater;
-  uint8_t *out = *output;
-  uint8_t *temp;
-  uint64_t length = *output_length;
-  uint64_t input_size = 0;
-  uint64_t written = 0;
-  input_size = frame->filled_size;
+  uint16_t index = (config->client_max_window_bits - MIN_WINDOW_BITS) * (MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1) +
+                   (config->server_max_window_bits - MIN_WINDOW_BITS);
+  index = index * 4 + config->client_no_context_takeover * 2 + config->server_no_context_takeover;
+  PMDResponse *cached = &pmd_response_cache[index];
+  if (cached->length == 0) {
+    cached->length = __pmd_format_response(config, cached->response);
+  }
+  memcpy(response, cached->response, cached->length + 1);
+  return cached->length;
+}
+
+void pmd_set_max_inflated_size(uint64_t size) { pmd_max_inflated_size = size; }
 
-  if (input_size == 0) {
+bool __pmd_init_inflater(PMDClientConfig *config) {
+  if (config->inflater != NULL) {
     return true;
   }
-  inflater->avail_in = input_size;
+  config->inflater = (z_stream *)malloc(sizeof(z_stream));
+  config->inflater->zalloc = Z_NULL;
+  config->inflater->zfree = Z_NULL;
+  config->inflater->opaque = Z_NULL;
+  config->inflater->avail_in = 0;
+  config->inflater->next_in = Z_NULL;
+  if (inflateInit2(config->inflater, -config->client_max_window_bits) != Z_OK) {
+    free(config->inflater);
+    config->inflater = NULL;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Inflate a compressed message at most CHUNK bytes at a time. Each chunk is either handed to the sink's emit function
+ * or appended to its output buffer. Inflation stops as soon as the message goes past the inflated size limit, so peak
+ * memory is bounded by the limit (or by a single chunk when emitting) regardless of the compression ratio.
+ */
+bool __pmd_inflate(PMDClientConfig *config, Frame *frame, PMDSink *sink) {
+  z_stream *inflater = config->inflater;
+  uint64_t total = 0;
+  uint64_t produced;
+  bool has_trailer = false;
+  int ret;
+
+  inflater->avail_in = frame->filled_size;
   inflater->next_in = frame->buffer;
-  do {
-    if (out == NULL) {
-      // typically output is at least twice the size of input.
-      length = 2 * input_size;
-      out = malloc(length);
-    } else {
-      length *= 2;
-      temp = realloc(out, length);
-      if (temp == NULL) {
-        free(out);
-        return 0;
-      }
-      out = temp;
+  while (true) {
+    if (sink->emit == NULL && !reserve_extension_buffer(sink->output, CHUNK)) {
+      return false;
     }
-    inflater->avail_out = length - written;
-    inflater->next_out = out + written;
-    ret = inflate(inflater, Z_NO_FLUSH);
-    written = length - inflater->avail_out;
-    if (ret == Z_STREAM_END || (ret == Z_OK && inflater->avail_out > 0)) {
-      if (inflater->avail_out < 8) {
-        length += 8;  // This should be more than enough
-        temp = realloc(out, length);
-        if (temp == NULL) {
-          free(out);
-          return 0;
-        }
-        out = temp;
-      }
-      inflater->avail_out = length - written;
-      inflater->next_out = out + written;
-      inflater->avail_in = 4;  // trailer bytes
-      inflater->next_in = (uint8_t *)TRAILER;
-      ret = inflate(inflater, Z_NO_FLUSH);
-      if (ret != Z_STREAM_END && ret != Z_OK) {
-        free(out);
-        return false;
+    inflater->avail_out = CHUNK;
+    inflater->next_out = sink->output->data + sink->output->length;
+    ret = inflate(inflater, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      return false;
+    }
+    produced = CHUNK - inflater->avail_out;
+    total += produced;
+    if (total > pmd_max_inflated_size) {
+      frame->close_code = TOO_LARGE;
+      return false;
+    }
+    if (sink->is_text && !validate_utf8_chunk(&sink->utf8_state, sink->output->data + sink->output->length, produced)) {
+      frame->close_code = INVALID_ENCODING;
+      return false;
+    }
+    if (sink->emit != NULL) {
+      if (produced > 0) {
+        sink->emit(sink->socketfd, sink->output->data, produced, false);
       }
-      written = length - inflater->avail_out;
-    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
-      free(out);
+    } else {
+      sink->output->length += produced;
+    }
+
+    if (ret == Z_STREAM_END) {
+      // The client ended the deflate stream, the next message will start a new one.
+      inflateReset(inflater);
+      break;
+    }
+    if (inflater->avail_out == 0) {
+      // There might be more output pending
+      continue;
+    }
+    if (inflater->avail_in > 0) {
+      // zlib couldn't make progress with the space it had.
       return false;
     }
-  } while (inflater->avail_out == 0);
+    if (has_trailer) {
+      break;
+    }
+    inflater->avail_in = 4;  // trailer bytes
+    inflater->next_in = (uint8_t *)TRAILER;
+    has_trailer = true;
+  }
 
   if (config->client_no_context_takeover) {
     inflateReset(inflater);
   }
-  *output = out;
-  *output_length = written;
+  if (sink->is_text && sink->utf8_state != UTF8_ACCEPT) {
+    // The message ended in the middle of a code point
+    frame->close_code = INVALID_ENCODING;
+    return false;
+  }
   return true;
 }
 
-uint64_t pmd_generate_response(int socketfd, uint8_t *input, uint64_t input_length, Frame *output_frame) {
+ExtensionResult pmd_process_data(int socketfd, Frame *frame, ExtensionBuffer *output) {
+  if (frame->rsv1 == 0) {
+    return EXTENSION_UNCHANGED;
+  }
+  PMDClientConfig *config = pmd_get_from_table(socketfd);
+  if (config == NULL || !__pmd_init_inflater(config)) {
+    return EXTENSION_FAILED;
+  }
+
+  PMDSink sink = {socketfd, output, NULL, frame->type == TEXT, UTF8_ACCEPT};
+  if (frame->filled_size > 0 && !__pmd_inflate(config, frame, &sink)) {
+    return EXTENSION_FAILED;
+  }
+  return EXTENSION_WRITTEN;
+}
+
+bool pmd_stream_data(int socketfd, Frame *frame, void (*emit)(int, uint8_t *, uint64_t, bool)) {
+  if (frame->rsv1 == 0) {
+    if (frame->type == TEXT && !validate_utf8((char *)frame->buffer, frame->filled_size)) {
+      frame->close_code = INVALID_ENCODING;
+      return false;
+    }
+    emit(socketfd, frame->buffer, frame->filled_size, true);
+    return true;
+  }
+  PMDClientConfig *config = pmd_get_from_table(socketfd);
+  if (config == NULL || !__pmd_init_inflater(config)) {
+    return false;
+  }
+
+  uint8_t chunk[CHUNK];
+  ExtensionBuffer output = {chunk, 0, CHUNK};
+  PMDSink sink = {socketfd, &output, emit, frame->type == TEXT, UTF8_ACCEPT};
+  if (frame->filled_size > 0 && !__pmd_inflate(config, frame, &sink)) {
+    return false;
+  }
+  emit(socketfd, chunk, 0, true);
+  return true;
+}
+
+void pmd_begin_shared_message(uint8_t *message, uint64_t length) {
+  pmd_end_shared_message();
+  pmd_shared_message.input = message;
+  pmd_shared_message.input_length = length;
+}
+
+void pmd_end_shared_message() {
+  for (int i = 0; i <= MAX_WINDOW_BITS - MIN_WINDOW_BITS; i++) {
+    if (pmd_shared_message.outputs[i] != NULL) {
+      free(pmd_shared_message.outputs[i]);
+      pmd_shared_message.outputs[i] = NULL;
+      pmd_shared_message.output_lengths[i] = 0;
+    }
+  }
+  pmd_shared_message.input = NULL;
+  pmd_shared_message.input_length = 0;
+}
+
+/**
+ * Get the slot of the shared compressed copies that a client can use for a message. Returns -1 if the client can't
+ * share its output, either because it keeps its compression context or because the message isn't being shared.
+ */
+int8_t __pmd_shared_slot(PMDClientConfig *config, uint8_t *input, uint64_t input_length) {
+  if (!config->server_no_context_takeover || pmd_shared_message.input == NULL ||
+      pmd_shared_message.input != input || pmd_shared_message.input_length != input_length) {
+    return -1;
+  }
+  return config->server_max_window_bits - MIN_WINDOW_BITS;
+}
+
+ExtensionResult pmd_generate_response(int socketfd, uint8_t *input, uint64_t input_length, ExtensionBuffer *output,
+                                      Frame *output_frame) {
   PMDClientConfig *config = pmd_get_from_table(socketfd);
   if (config == NULL) {
-    return 0;
+    return EXTENSION_FAILED;
+  }
+  output_frame->rsv1 = true;
+  int8_t slot = __pmd_shared_slot(config, input, input_length);
+  if (slot >= 0 && pmd_shared_message.outputs[slot] != NULL) {
+    // Another client with the same window size already compressed this message.
+    uint64_t shared_length = pmd_shared_message.output_lengths[slot];
+    if (!reserve_extension_buffer(output, shared_length)) {
+      return EXTENSION_FAILED;
+    }
+    memcpy(output->data, pmd_shared_message.outputs[slot], shared_length);
+    output->length = shared_length;
+    return EXTENSION_WRITTEN;
   }
   int ret;
   if (config->deflater == NULL) {
@@ -277,47 +386,41 @@ uint64_t pmd_generate_response(int socketfd, uint8_t *input, uint64_t input_leng
     ret = deflateInit2(config->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -config->server_max_window_bits, 8,
                        Z_DEFAULT_STRATEGY);
     if (ret != Z_OK) {
-      return 0;
+      free(config->deflater);
+      config->deflater = NULL;
+      return EXTENSION_FAILED;
     }
   }
   z_stream *deflater = config->deflater;
-  uint64_t written = 0;
-  uint8_t *out = NULL;
-  uint8_t *temp;
-  uint64_t length;
+  // deflateBound doesn't count the empty block written by the sync flush.
+  uint64_t size = deflateBound(deflater, input_length) + 8;
   deflater->avail_in = input_length;
   deflater->next_in = input;
   do {
-    if (out == NULL) {
-      // typically output is at least twice the size of input.
-      length = input_length;
-      out = malloc(length);
-    } else {
-      length *= 2;
-      temp = realloc(out, length);
-      if (temp == NULL) {
-        free(out);
-        return 0;
-      }
-      out = temp;
+    if (!reserve_extension_buffer(output, size)) {
+      return EXTENSION_FAILED;
     }
-    deflater->avail_out = length - written;
-    deflater->next_out = out + written;
+    deflater->avail_out = output->capacity - output->length;
+    deflater->next_out = output->data + output->length;
     ret = deflate(deflater, Z_SYNC_FLUSH);
-    written = length - deflater->avail_out;
+    output->length = output->capacity - deflater->avail_out;
     if (ret != Z_OK && ret != Z_STREAM_END) {
-      free(out);
-      return 0;
+      return EXTENSION_FAILED;
     }
+    size = CHUNK;
   } while (deflater->avail_out == 0);
   if (config->server_no_context_takeover) {
     deflateReset(deflater);
   }
-  output_frame->buffer = out;
-  output_frame->buffer_size = written - 4;   // Remove trailing bits
-  output_frame->payload_size = written - 4;  // Remove trailing bits
-  output_frame->rsv1 = true;
-  return written - 4;
+  output->length -= 4;  // Remove trailing bits
+  if (slot >= 0) {
+    pmd_shared_message.outputs[slot] = malloc(output->length);
+    if (pmd_shared_message.outputs[slot] != NULL) {
+      memcpy(pmd_shared_message.outputs[slot], output->data, output->length);
+      pmd_shared_message.output_lengths[slot] = output->length;
+    }
+  }
+  return EXTENSION_WRITTEN;
 }
 
 void pmd_close(int socketfd) { pmd_delete_from_table(socketfd); }
\ No newline at end of file
@@ -6,10 +6,12 @@
 #include "defs.h"
 #include "extension.h"
 
+#define MIN_WINDOW_BITS 8
 #define MAX_WINDOW_BITS 15
 #define DEFAULT_NO_CONTEXT_TAKEOVER false
 #define CHUNK 16384
 #define TRAILER "\x00\x00\xff\xff"
+#define DEFAULT_MAX_INFLATED_SIZE MAX_PAYLOAD_SIZE
 
 /**
  * Config for a single client
@@ -30,11 +32,86 @@ struct pmd_client_config {
 // Table containing all the connected clients config.
 static PMDClientConfig *pmd_config_table[HASHTABLE_SIZE];
 
+// Largest message we are willing to inflate. Compressed frames are bounded by MAX_PAYLOAD_SIZE on the wire, but a
+// small frame can inflate to something much larger, so the inflated size needs its own limit.
+static uint64_t pmd_max_inflated_size = DEFAULT_MAX_INFLATED_SIZE;
+
+/**
+ * Destination of inflated data. If `emit` is set, every chunk is handed to it as soon as zlib produces it and the
+ * buffer is reused. Otherwise, the chunks are accumulated in the buffer. Text messages are validated chunk by chunk
+ * while they are still in cache, `utf8_state` carries the validation state from one chunk to the next.
+ */
+typedef struct pmd_sink PMDSink;
+
+struct pmd_sink {
+  int socketfd;
+  ExtensionBuffer *output;
+  void (*emit)(int, uint8_t *, uint64_t, bool);
+  bool is_text;
+  uint8_t utf8_state;
+};
+
+/**
+ * Compressed copies of a message that is being sent to many clients. Clients that negotiated
+ * server_no_context_takeover reset their deflater after every message, so the same message compresses to the same
+ * bytes for every one of them that uses the same window size. We compress it once per window size and share it.
+ * The message is identified by its address and length, so the copies are only valid between
+ * pmd_begin_shared_message and pmd_end_shared_message.
+ */
+typedef struct pmd_shared_message PMDSharedMessage;
+
+struct pmd_shared_message {
+  uint8_t *input;
+  uint64_t input_length;
+  uint8_t *outputs[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+  uint64_t output_lengths[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+};
+
+static PMDSharedMessage pmd_shared_message;
+
+/**
+ * Responses to offers, keyed by the negotiated params. There are only a few hundred possible responses, so each one
+ * is formatted the first time it is needed and copied from here afterwards.
+ */
+#define PMD_RESPONSE_SIZE 160
+#define PMD_RESPONSE_COUNT ((MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1) * (MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1) * 4)
+
+typedef struct pmd_response PMDResponse;
+
+struct pmd_response {
+  uint16_t length;  // 0 until the response is formatted
+  char response[PMD_RESPONSE_SIZE];
+};
+
+static PMDResponse pmd_response_cache[PMD_RESPONSE_COUNT];
+
+/**
+ * Start sharing compressed copies of a message between clients.
+ *
+ * @param message Message that is about to be sent to many clients
+ * @param length Message length
+ */
+void pmd_begin_shared_message(uint8_t *message, uint64_t length);
+
+/**
+ * Stop sharing compressed copies of the current message and release them.
+ */
+void pmd_end_shared_message();
+
+/**
+ * Set the largest size a message can inflate to. Messages that inflate past it are rejected with TOO_LARGE.
+ *
+ * @param size Inflated size limit in bytes
+ */
+void pmd_set_max_inflated_size(uint64_t size);
+
 bool pmd_validate_offer(int socketfd, ExtensionParam *param);
 uint16_t pmd_respond(int socketfd, char *response);
 bool pmd_validate_rsv(int socketfd, bool rsv1, bool rsv2, bool rsv3);
-bool pmd_process_data(int socketfd, Frame *frame, uint8_t **output, uint64_t *output_length);
-uint64_t pmd_generate_response(int socketfd, uint8_t *input, uint64_t input_length, Frame *output_frame);
+ExtensionResult pmd_process_data(int socketfd, Frame *frame, ExtensionBuffer *output);
+bool pmd_stream_data(int socketfd, Frame *frame, void (*emit)(int, uint8_t *, uint64_t, bool));
+ExtensionResult pmd_generate_response(int socketfd, uint8_t *input, uint64_t input_length, ExtensionBuffer *output,
+                                      Frame *output_frame);
 void pmd_close(int socketfd);
 
 #endif
\ No newline at end of file
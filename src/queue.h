@@ -0,0 +1,112 @@
+/**
+ * Lock-free multiple producer single consumer queue. Any thread can push, but only the thread running the event loop
+ * pops. Nodes are intrusive, so pushing never allocates. Based on Dmitry Vyukov's intrusive MPSC queue. A push is a
+ * single atomic exchange and a pop takes no atomic read-modify-write at all.
+ */
+#ifndef NITROWS_SRC_QUEUE_H
+#define NITROWS_SRC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct queue_node QueueNode;
+
+struct queue_node {
+  QueueNode *next;
+};
+
+typedef struct mpsc_queue MPSCQueue;
+
+struct mpsc_queue {
+  QueueNode *head;  // Last pushed node. Producers swap it.
+  QueueNode *tail;  // Next node to pop. Only the consumer uses it.
+  QueueNode stub;   // Keeps the queue non-empty, so producers never touch tail
+
+  // Whether the consumer has been told about pushed nodes it hasn't popped yet. It lets producers skip waking it up
+  // when it already will be.
+  bool is_signaled;
+};
+
+/**
+ * Initialize a queue.
+ *
+ * @param queue Queue to initialize
+ */
+static inline void queue_init(MPSCQueue *queue) {
+  queue->stub.next = NULL;
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+  queue->is_signaled = false;
+}
+
+/**
+ * Link a node behind the head.
+ */
+static inline void __queue_link(MPSCQueue *queue, QueueNode *node) {
+  __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+  QueueNode *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+  // Between the exchange and this store, the node can't be reached from the tail yet. The consumer treats the queue
+  // as empty until it can.
+  __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * Push a node. Safe to call from any thread.
+ *
+ * @param queue Queue to push to
+ * @param node Node to push
+ *
+ * @returns true if the consumer has to be woken up for the node, false if it already has been
+ */
+static inline bool queue_push(MPSCQueue *queue, QueueNode *node) {
+  __queue_link(queue, node);
+  return !__atomic_exchange_n(&queue->is_signaled, true, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Called by the consumer once it's woken up, before it pops. Nodes pushed after it wake the consumer up again. It's an
+ * exchange rather than a store so that it synchronizes with the producer that set the flag, and that producer's node
+ * is visible to the pops that follow.
+ *
+ * @param queue Queue being consumed
+ */
+static inline void queue_clear_signal(MPSCQueue *queue) {
+  (void)__atomic_exchange_n(&queue->is_signaled, false, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Pop the oldest node. Only the consumer thread can call it.
+ *
+ * @param queue Queue to pop from
+ *
+ * @returns oldest node. NULL if the queue is empty or the next node is still being pushed.
+ */
+static inline QueueNode *queue_pop(MPSCQueue *queue) {
+  QueueNode *tail = queue->tail;
+  QueueNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &queue->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    queue->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  // The tail is the last node. The stub is pushed behind it so the tail can be handed out.
+  __queue_link(queue, &queue->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+#endif
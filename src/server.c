@@ -1,8 +1,7 @@
 #include "server.h"
 
+#include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <openssl/sha.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,14 +10,54 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#include "base64.h"
 #include "defs.h"
 #include "events.h"
 #include "frame.h"
+#include "handlers.h"
+#include "handshake.h"
 #include "header.h"
+#include "timer.h"
+#include "tls.h"
+#include "workers.h"
+
+/**
+ * Send what a client has waiting once its socket is writable. Pending messages follow once the send buffer drains, and
+ * the writable handler runs if the client had a message refused and drained to the low watermark. The handler can
+ * send or close the client safely from here.
+ */
+void __handle_writable(Client *client) {
+  bool was_empty = client->send_buffer == NULL;
+  send_frame(client, NULL, -1);
+  bool is_flushed = flush_pending_messages(client);
+  if (client->send_buffer == NULL && (was_empty || is_flushed || client->is_send_blocked)) {
+    // Write notifications were kept on for the pending messages or the writable handler, which are taken care of
+    set_write_notify(client->socketfd, false);
+  }
+  if (client->is_send_blocked && get_queued_bytes(client) <= send_watermarks.low) {
+    client->is_send_blocked = false;
+    deliver_writable(client);
+  }
+}
 
 void handle_connection(int socketfd, bool is_send, bool is_close) {
   Client *client = get_client(socketfd);
+#ifdef NITROWS_TLS
+  // The TLS handshake comes before the upgrade request. It can wait for the socket to be readable or writable.
+  if (client == NULL && is_tls_handshake_pending(socketfd)) {
+    TlsHandshakeStatus status = continue_tls_handshake(socketfd);
+    if (status == TLS_HANDSHAKE_FAILED) {
+      close_connection(socketfd);
+    } else if (status == TLS_HANDSHAKE_DONE) {
+      // The upgrade request can arrive right behind the handshake, and it won't be reported again
+      handle_upgrade(socketfd);
+    }
+    return;
+  }
+#endif
+  if (client == NULL && is_send) {
+    // The client was closed while handling an earlier event for the same socket, or hasn't upgraded yet
+    return;
+  }
   if (client == NULL) {
     // If a client is not in the table, then it is probably initiating the websocket protocol by sending a connection
     handle_upgrade(socketfd);
@@ -28,14 +67,38 @@ void handle_connection(int socketfd, bool is_send, bool is_close) {
     if (!is_send && !is_close) {
       handle_client_data(client);
     } else if (is_send) {
-      send_frame(client, NULL, -1);
+      __handle_writable(client);
     } else {
       close_client(client);
     }
   }
 }
 
+Timeouts *get_timeouts() { return &timeouts; }
+
+Heartbeat *get_heartbeat() { return &heartbeat; }
+
+SendWatermarks *get_send_watermarks() { return &send_watermarks; }
+
+uint64_t get_queued_bytes(Client *client) {
+  uint64_t buffered = (client->send_buffer == NULL) ? 0 : client->send_buffer_size - client->send_start;
+  return buffered + client->pending_bytes;
+}
+
+bool is_over_high_watermark(Client *client, uint64_t size) {
+  uint64_t queued = get_queued_bytes(client);
+  if (send_watermarks.high == 0 || queued == 0 || queued + size <= send_watermarks.high) {
+    return false;
+  }
+  client->is_send_blocked = true;
+  return true;
+}
+
 void close_connection(int socketfd) {
+  stop_handshake_timer(socketfd);
+#ifdef NITROWS_TLS
+  close_tls(socketfd);
+#endif
   close(socketfd);
   delete_from_event_loop(socketfd);
 }
@@ -54,7 +117,7 @@ void send_error_response(int socketfd, int status_code, char message[]) {
                      "HTTP/1.1 %d %s\r\nConnection: close\r\nContent-Type: text/html\r\nContent-Length: %lu\r\n\r\n%s",
                      status_code, status_400, strlen(message), message);
   }
-  int sent = send(socketfd, response, length, 0);
+  int sent = socket_send(socketfd, response, length);
   if (sent == -1) {
     perror("send");
   }
@@ -67,8 +130,7 @@ void send_error_response(int socketfd, int status_code, char message[]) {
  * them.
  *
  * @param socketfd Client socket descriptor
- * @param key Contains the Sec-Websocket-Key value. This function will
- * concatenate its value and the GUID and add them to the buffer.
+ * @param key Contains the Sec-Websocket-Key value.
  * @param subprotocol Contains the first protocol from the request's
  * Sec-Websocket-Protocol values. Can be empty
  * @param subprotocol_len Subprotocol string length. 0 if subprotocol is empty
@@ -80,48 +142,11 @@ void send_error_response(int socketfd, int status_code, char message[]) {
  */
 bool __send_upgrade_response(int socketfd, uint8_t key[], char subprotocol[], int subprotocol_len,
                              uint8_t extension_indices[], uint8_t indices_count) {
-  uint16_t ext_response_length;
-  uint16_t length;
-  char response[4096];
-  char ext_response[512];
-  uint8_t base64[29];
-  uint8_t sha1[20];
-  // Create `Sec-WebSocket-Accept` value
-  strncpy((char *)key + 24, GUID, 36);
-  SHA1(key, 60, sha1);
-  base64_encode((uint8_t *)sha1, base64, 20);
-  base64[28] = '\0';
-
-  // Format response based on the presence of subprotocols
-  if (subprotocol_len > 0) {
-    length = sprintf(response,
-                     "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: "
-                     "Upgrade\r\nSec-WebSocket-Accept: %s\r\nSec-WebSocket-Protocol: %s\r\n",
-                     base64, subprotocol);
-  } else {
-    length = sprintf(
-        response,
-        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n",
-        base64);
-  }
-  if (indices_count > 0) {
-    Extension *extension;
-    for (uint8_t i = 0; i < indices_count && length < 4094; i++) {
-      extension = get_extension(extension_indices[i]);
-      if (extension == NULL) {
-        continue;
-      }
-      ext_response_length = extension->respond_to_offer(socketfd, ext_response);
-      if (ext_response_length > 512 || (ext_response_length + length) > 4066) {
-        continue;
-      }
-      length += sprintf(response + length, "Sec-Websocket-Extensions: %s\r\n", ext_response);
-    }
-  }
-  response[length++] = '\r';
-  response[length++] = '\n';
+  char response[HANDSHAKE_RESPONSE_SIZE];
+  uint16_t length =
+      build_upgrade_response(socketfd, response, key, subprotocol, subprotocol_len, extension_indices, indices_count);
 
-  int sent = send(socketfd, response, length, 0);
+  int sent = socket_send(socketfd, response, length);
   if (sent == -1) {
     perror("send");
     close_connection(socketfd);
@@ -147,22 +172,26 @@ void handle_upgrade(int socketfd) {
   uint16_t total = 0;  // Size Of upgrade request
   char *p;
   char buf[BUFFER_SIZE];  // Buffer that holds request
-  uint8_t key[60];        // Buffer that holds sec-websocket-accept value
+  uint8_t key[24];        // Buffer that holds sec-websocket-key value
   char subprotocol[100];
   uint8_t *extension_indices;
   uint8_t indices_count;
   int subprotocol_len;
+  int32_t request_length = -1;  // Size of the request up to the end of its headers
+  Client *client = NULL;
   IncompleteRequest *connection_header = get_request(socketfd);
-  if (connection_header == NULL) {
-    // New connection request, make socket non-blocking
-    fcntl(socketfd, F_SETFL, O_NONBLOCK);
+  if (connection_header != NULL) {
+    // Continue with the part of the request received earlier, so that its end is found even if it's split across reads
+    memcpy(buf, connection_header->buffer, connection_header->buffer_size);
+    total = connection_header->buffer_size;
   }
 
-  while ((nbytes = recv(socketfd, buf + total, BUFFER_SIZE - total, 0)) > 0) {
+  while ((nbytes = socket_recv(socketfd, buf + total, BUFFER_SIZE - total)) > 0) {
     total += nbytes;
 
-    // Check for http request validity and break if it's valid
-    if (buf[total - 4] == '\r' && buf[total - 3] == '\n' && buf[total - 2] == '\r' && buf[total - 1] == '\n') {
+    // Check for http request validity and break if it's valid. Only the new data needs to be scanned.
+    request_length = find_request_end(buf, total, total - nbytes);
+    if (request_length != -1) {
       break;
     }
   }
@@ -188,14 +217,12 @@ void handle_upgrade(int socketfd) {
   }
 
   if (nbytes < 0) {
-    if (connection_header == NULL && total < BUFFER_SIZE && __is_get_request(buf, total)) {
-      add_request(socketfd, buf, total);
-    } else if (connection_header == NULL && !__is_get_request(buf, total)) {
+    // Only the newly received data is appended to what's already stored
+    uint16_t stored = connection_header != NULL ? connection_header->buffer_size : 0;
+    if (connection_header == NULL && !__is_get_request(buf, total)) {
       send_error_response(socketfd, 405, "Method not allowed");
-    } else if (connection_header != NULL && (connection_header->buffer_size + total) < BUFFER_SIZE) {
-      memcpy(connection_header->buffer + connection_header->buffer_size, buf, total);
-      connection_header->buffer_size += total;
-    } else if (connection_header != NULL) {
+    } else if ((total >= BUFFER_SIZE || !add_request(socketfd, buf + stored, total - stored)) &&
+               connection_header != NULL) {
       delete_request(connection_header);
     }
     return;
@@ -203,22 +230,17 @@ void handle_upgrade(int socketfd) {
 
   if (connection_header == NULL && !__is_get_request(buf, nbytes)) {
     send_error_response(socketfd, 405, "Method not allowed");
+    return;
   }
 
-  if (connection_header == NULL) {
-    p = buf;
-  } else {
-    memcpy(connection_header->buffer + connection_header->buffer_size, buf, total);
-    connection_header->buffer_size += total;
-    p = connection_header->buffer;
-    total = connection_header->buffer_size;
-  }
+  p = buf;
 
   subprotocol_len = 0;
   indices_count = 0;
   extension_indices = NULL;
 
-  if (!validate_headers(p, total, socketfd, key, subprotocol, subprotocol_len, &extension_indices, &indices_count)) {
+  if (!validate_headers(p, request_length, socketfd, key, subprotocol, subprotocol_len, &extension_indices,
+                        &indices_count)) {
     if (connection_header != NULL) {
       delete_request(connection_header);
     }
@@ -227,63 +249,177 @@ void handle_upgrade(int socketfd) {
 
   bool sent = __send_upgrade_response(socketfd, key, subprotocol, subprotocol_len, extension_indices, indices_count);
   if (sent == true) {
-    init_client(socketfd, extension_indices, indices_count);
+    client = init_client(socketfd, extension_indices, indices_count);
+    stop_handshake_timer(socketfd);
+    start_heartbeat(client);
   }
   if (connection_header != NULL) {
     delete_request(connection_header);
   }
+  if (client == NULL) {
+    return;
+  }
+  // The open handler runs before the client's first message, so it can set the user data the message handlers get
+  NitrowsHandler *handler = get_handlers();
+  if (handler->handle_open != NULL) {
+    handler->handle_open(socketfd);
+    // It might have closed the client
+    if ((client = get_client(socketfd)) == NULL) {
+      return;
+    }
+  }
+
+  // A client can send its first frames right behind the request without waiting for the response. Whatever was read
+  // along with the request is parsed now. The rest is still in the socket, which won't be reported as readable again
+  // under edge triggering, so it's read right away.
+  if (total > request_length && !process_client_data(client, (uint8_t *)buf + request_length, total - request_length)) {
+    return;
+  }
+  handle_client_data(client);
 }
 
 void close_client(Client *client) {
-  close_connection(client->socketfd);
+  int socketfd = client->socketfd;
+  uint64_t generation = client->generation;
+  void *userdata = client->userdata;
+  stop_timer(&client->timer);
+  stop_timer(&client->heartbeat_timer);
+  close_connection(socketfd);
   delete_client(client);
+  // The client is gone by the time the close handler runs, so anything it does with the client id fails cleanly
+  deliver_close(socketfd, generation, userdata);
+}
+
+/**
+ * Close an idle client, or one that didn't answer our close frame in time.
+ */
+void __client_timeout(Timer *timer, void *data) {
+  Client *client = (Client *)data;
+  if (client->status == CLOSING) {
+    close_client(client);
+  } else {
+    start_closing(client->socketfd);
+  }
+}
+
+void wait_for_close(Client *client) {
+  client->status = CLOSING;
+  if (timeouts.close != 0) {
+    start_timer(&client->timer, timeouts.close, __client_timeout, client);
+  } else {
+    stop_timer(&client->timer);
+  }
+}
+
+/**
+ * Send a heartbeat ping, or close the client if it left too many of them unanswered.
+ */
+void __send_heartbeat(Timer *timer, void *data) {
+  Client *client = (Client *)data;
+  if (client->status != CONNECTED) {
+    return;
+  }
+  if (client->last_ping_time != 0 && ++client->missed_pongs >= heartbeat.max_missed_pongs) {
+    close_client(client);
+    return;
+  }
+  uint64_t now = get_time_us();
+  if (send_ping_frame(client, (uint8_t *)&now, sizeof(now))) {
+    client->last_ping_time = now;
+  }
+  start_timer(&client->heartbeat_timer, heartbeat.interval, __send_heartbeat, client);
+}
+
+void start_heartbeat(Client *client) {
+  if (heartbeat.interval != 0) {
+    start_timer(&client->heartbeat_timer, heartbeat.interval, __send_heartbeat, client);
+  }
+}
+
+void handle_pong(Client *client, uint8_t *data, uint64_t size) {
+  uint64_t sent_time;
+  if (size != sizeof(sent_time) || client->last_ping_time == 0) {
+    return;
+  }
+  // Only our pings carry a time. An answer to an earlier ping, because the round trip took longer than the interval,
+  // still shows the client is alive and gives its round trip time. Times older than the oldest ping the client can
+  // have left unanswered weren't sent by us, and would make up a round trip time.
+  memcpy(&sent_time, data, sizeof(sent_time));
+  uint64_t unanswered_time = (uint64_t)heartbeat.max_missed_pongs * heartbeat.interval * 1000;
+  if (sent_time > client->last_ping_time || client->last_ping_time - sent_time > unanswered_time) {
+    return;
+  }
+  client->rtt = get_time_us() - sent_time;
+  client->last_ping_time = 0;
+  client->missed_pongs = 0;
+}
+
+bool process_client_data(Client *client, uint8_t *buf, int nbytes) {
+  int read;
+  int total_read = 0;
+  while (total_read != nbytes) {
+    read = 0;
+    // Mask key is the last info in the frame header and is stored in a
+    // character buffer. It's used as a proxy to determine if the frame's
+    // header data has been extracted. If the length of that buffer isn't
+    // 4, the frame header hasn't been completely extracted.
+    if (client->mask_size != 4) {
+      read = extract_header_data(client, buf + total_read, nbytes - total_read);
+      if (read < 0) {
+        close_client(client);
+        return false;
+      }
+    }
+    total_read += read;
+    // Some frames have an empty payload. This ensures we don't ignore them
+    if (nbytes == total_read &&
+        ((client->mask_size == 4 &&
+          ((client->current_frame_type == CONTROL_FRAME && client->control_frame.payload_size > 0) ||
+           (client->current_frame_type == DATA_FRAME && client->data_frame.payload_size > 0))) ||
+         client->mask_size < 4)) {
+      break;
+    }
+
+    if (client->current_frame_type == CONTROL_FRAME) {
+      read = handle_control_frame(client, buf + total_read, nbytes - total_read);
+    } else {
+      read = handle_data_frame(client, buf + total_read, nbytes - total_read);
+    }
+    if (read < 0) {
+      close_client(client);
+      return false;
+    }
+    total_read += read;
+  }
+  // Pings in the data are answered once, with the payload of the latest one
+  if (!send_due_pong(client)) {
+    close_client(client);
+    return false;
+  }
+  return true;
 }
 
 void handle_client_data(Client *client) {
   int nbytes;
-  int read;
-  int total_read;
   int to_read_size;
   uint8_t data[BUFFER_SIZE];
   uint8_t *buf;
   buf = data;
   to_read_size = BUFFER_SIZE;
+  if (client->is_reading_paused) {
+    return;
+  }
+  if (timeouts.idle != 0 && client->status == CONNECTED) {
+    start_timer(&client->timer, timeouts.idle, __client_timeout, client);
+  }
 
-  while ((nbytes = recv(client->socketfd, buf, to_read_size, 0)) > 0) {
-    total_read = 0;
-    while (total_read != nbytes) {
-      read = 0;
-      // Mask key is the last info in the frame header and is stored in a
-      // character buffer. It's used as a proxy to determine if the frame's
-      // header data has been extracted. If the length of that buffer isn't
-      // 4, the frame header hasn't been completely extracted.
-      if (client->mask_size != 4) {
-        read = extract_header_data(client, buf + total_read, nbytes - total_read);
-        if (read < 0) {
-          close_client(client);
-          return;
-        }
-      }
-      total_read += read;
-      // Some frames have an empty payload. This ensures we don't ignore them
-      if (nbytes == total_read &&
-          ((client->mask_size == 4 &&
-            ((client->current_frame_type == CONTROL_FRAME && client->control_frame.payload_size > 0) ||
-             (client->current_frame_type == DATA_FRAME && client->data_frame.payload_size > 0))) ||
-           client->mask_size < 4)) {
-        break;
-      }
-
-      if (client->current_frame_type == CONTROL_FRAME) {
-        read = handle_control_frame(client, buf + total_read, nbytes - total_read);
-      } else {
-        read = handle_data_frame(client, buf + total_read, nbytes - total_read);
-      }
-      if (read < 0) {
-        close_client(client);
-        return;
-      }
-      total_read += read;
+  while ((nbytes = socket_recv(client->socketfd, buf, to_read_size)) > 0) {
+    if (!process_client_data(client, buf, nbytes)) {
+      return;
+    }
+    // A handler paused the client. The rest stays in the socket until it's resumed.
+    if (client->is_reading_paused) {
+      return;
     }
 
     // We can avoid unnecessary copying by storing data directly in the frame buffer
@@ -312,6 +448,212 @@ void handle_client_data(Client *client) {
   }
 }
 
+/**
+ * Push a queued message or close request and wake up the loop if needed.
+ */
+void __push_queued(QueuedMessage *queued) {
+  // Only the first message since the loop last drained the queue has to wake it up
+  if (queue_push(&send_queue, &queued->node)) {
+    signal_wakeup();
+  }
+}
+
+bool queue_message(int socketfd, uint64_t generation, uint8_t *message, uint64_t length, Opcode type) {
+  return queue_conflated_message(socketfd, generation, 0, 0, message, length, type);
+}
+
+bool queue_conflated_message(int socketfd, uint64_t generation, uint64_t key, uint64_t expires_at, uint8_t *message,
+                             uint64_t length, Opcode type) {
+  QueuedMessage *queued = (QueuedMessage *)malloc(sizeof(QueuedMessage) + length);
+  if (queued == NULL) {
+    return false;
+  }
+  queued->socketfd = socketfd;
+  queued->generation = generation;
+  queued->action = QUEUED_SEND;
+  queued->key = key;
+  queued->expires_at = expires_at;
+  queued->type = type;
+  queued->length = length;
+  memcpy(queued->data, message, length);
+  __push_queued(queued);
+  return true;
+}
+
+bool queue_action(int socketfd, uint64_t generation, QueuedAction action) {
+  QueuedMessage *queued = (QueuedMessage *)malloc(sizeof(QueuedMessage));
+  if (queued == NULL) {
+    return false;
+  }
+  queued->socketfd = socketfd;
+  queued->generation = generation;
+  queued->action = action;
+  queued->key = 0;
+  queued->expires_at = 0;
+  queued->length = 0;
+  __push_queued(queued);
+  return true;
+}
+
+void pause_reading(Client *client) {
+  if (client->is_reading_paused) {
+    return;
+  }
+  client->is_reading_paused = true;
+  // A paused client isn't idle or unresponsive, we just don't read what it sends, its pongs included
+  if (client->status == CONNECTED) {
+    stop_timer(&client->timer);
+  }
+  stop_timer(&client->heartbeat_timer);
+  set_read_notify(client->socketfd, false);
+}
+
+bool resume_reading(Client *client) {
+  if (!client->is_reading_paused) {
+    return true;
+  }
+  client->is_reading_paused = false;
+  // Pings sent before the pause are forgotten, since their pongs waited unread
+  if (client->status == CONNECTED) {
+    client->last_ping_time = 0;
+    client->missed_pongs = 0;
+    start_heartbeat(client);
+  }
+  set_read_notify(client->socketfd, true);
+  return queue_action(client->socketfd, client->generation, QUEUED_READ);
+}
+
+/**
+ * Get the client a queued entry is for. An entry for a client that's gone is dropped, even if a new client has its
+ * socket by now.
+ *
+ * @returns client. NULL if it's gone.
+ */
+Client *__get_queued_client(QueuedMessage *queued) {
+  Client *client = get_client(queued->socketfd);
+  if (client == NULL || (queued->generation != 0 && client->generation != queued->generation)) {
+    return NULL;
+  }
+  return client;
+}
+
+/**
+ * Run an action queued for a client.
+ */
+void __run_queued_action(QueuedMessage *queued) {
+  Client *client = __get_queued_client(queued);
+  if (client == NULL) {
+    return;
+  }
+  if (queued->action == QUEUED_CLOSE) {
+    start_closing(client->socketfd);
+  } else if (queued->action == QUEUED_PAUSE_READING) {
+    pause_reading(client);
+  } else if (queued->action == QUEUED_RESUME_READING) {
+    resume_reading(client);
+  } else if (!client->is_reading_paused) {
+    // Data that arrived while the client was paused, or was left in its TLS session, isn't reported by the loop
+    handle_client_data(client);
+  }
+}
+
+void send_queued_messages() {
+  QueueNode *node = NULL;
+  QueuedMessage *queued = NULL;
+  queue_clear_signal(&send_queue);
+  for (int i = 0; i < SEND_QUEUE_BATCH_SIZE; i++) {
+    node = queue_pop(&send_queue);
+    if (node == NULL) {
+      return;
+    }
+    queued = (QueuedMessage *)node;
+    if (queued->action != QUEUED_SEND) {
+      __run_queued_action(queued);
+    } else if (__get_queued_client(queued) != NULL) {
+      send_conflated_data_frame(queued->socketfd, queued->key, queued->expires_at, queued->data, queued->length,
+                                queued->type);
+    }
+    free(queued);
+  }
+  signal_wakeup();
+}
+
+/**
+ * Move the frame boundaries of a client's send buffer past the data that was sent. A control frame that started going
+ * out can't be replaced anymore. Neither can the frames in a write OpenSSL couldn't finish, since it already encrypted
+ * them and sends that on the retry.
+ */
+void __update_send_boundaries(Client *client) {
+  uint8_t *header = NULL;
+  uint64_t length = 0;
+  uint64_t started = client->send_start + get_pending_write_size(client->socketfd);
+  while (client->send_frame_end < started) {
+    header = client->send_buffer + client->send_frame_end;
+    length = header[1] & MAX_PAYLOAD_VALUE;
+    if (length == MAX_PAYLOAD_VALUE - 1) {
+      uint16_t s = 0;
+      memcpy(&s, header + 2, 2);
+      length = (uint64_t)ntohs(s) + 4;
+    } else if (length == MAX_PAYLOAD_VALUE) {
+      uint64_t s = 0;
+      memcpy(&s, header + 2, 8);
+      length = ntohll(s) + 10;
+    } else {
+      length += 2;
+    }
+    client->send_frame_end += length;
+  }
+  if (client->send_control_end < client->send_frame_end) {
+    client->send_control_end = client->send_frame_end;
+  }
+  if (client->pong_size != 0 && client->pong_start < started) {
+    client->pong_size = 0;
+  }
+}
+
+bool send_control_frame(Client *client, uint8_t *frame, uint8_t size) {
+  if (client->send_buffer == NULL) {
+    return send_frame(client, frame, size);
+  }
+  __update_send_boundaries(client);
+  Opcode type = frame[0] & 15;
+  uint64_t offset = client->send_control_end;
+  uint64_t replaced_size = 0;
+  if (type == PONG && client->pong_size != 0) {
+    offset = client->pong_start;
+    replaced_size = client->pong_size;
+  }
+  // Nothing can follow a close frame, so the data behind it is dropped
+  uint64_t tail_size = (type == CLOSE) ? 0 : client->send_buffer_size - offset - replaced_size;
+  uint64_t total_size = offset + size + tail_size;
+  if (total_size > client->send_buffer_capacity) {
+    uint64_t capacity = client->send_buffer_capacity * 2;
+    if (capacity < total_size) {
+      capacity = total_size;
+    }
+    uint8_t *buf = realloc(client->send_buffer, capacity);
+    if (buf == NULL) {
+      perror("realloc");
+      return false;
+    }
+    client->send_buffer = buf;
+    client->send_buffer_capacity = capacity;
+  }
+  // Pongs usually echo pings of the same size, so a newer one overwrites the old one without moving the data
+  if (size != replaced_size) {
+    memmove(client->send_buffer + offset + size, client->send_buffer + offset + replaced_size, tail_size);
+  }
+  memcpy(client->send_buffer + offset, frame, size);
+  client->send_buffer_size = total_size;
+  client->send_control_end = (type == CLOSE) ? total_size : client->send_control_end + size - replaced_size;
+  if (type == PONG) {
+    client->pong_start = offset;
+    client->pong_size = size;
+  }
+  // The buffer holds data, so write notifications are on and the frame goes out once the socket is writable
+  return true;
+}
+
 bool send_frame(Client *client, uint8_t *frame, uint64_t size) {
   if (frame == NULL && client->send_buffer == NULL) {
     return true;
@@ -325,26 +667,34 @@ bool send_frame(Client *client, uint8_t *frame, uint64_t size) {
     total_size = client->send_buffer_size;
 
     if (frame != NULL) {
-      total_size = total_size - total_bytes_sent;
-      if (total_bytes_sent == 0) {
-        buf = realloc(client->send_buffer, total_size + size);
-        if (buf != NULL) {
-          client->send_buffer = buf;
-          memcpy(client->send_buffer + total_size, frame, size);
-          client->send_buffer_size = total_size + size;
+      // The sent part is dropped before the buffer grows, or once it's larger than the unsent part. Appending stays
+      // amortized constant time however much a slow reader has queued.
+      if (total_bytes_sent > 0 && (total_size + size > client->send_buffer_capacity ||
+                                   total_bytes_sent >= total_size - total_bytes_sent)) {
+        __update_send_boundaries(client);
+        client->send_frame_end -= total_bytes_sent;
+        client->send_control_end -= total_bytes_sent;
+        client->pong_start -= total_bytes_sent;
+        total_size -= total_bytes_sent;
+        memmove(client->send_buffer, client->send_buffer + total_bytes_sent, total_size);
+        client->send_start = total_bytes_sent = 0;
+        client->send_buffer_size = total_size;
+      }
+      if (total_size + size > client->send_buffer_capacity) {
+        uint64_t capacity = client->send_buffer_capacity * 2;
+        if (capacity < total_size + size) {
+          capacity = total_size + size;
         }
-      } else {
-        buf = malloc(total_size + size);
-        if (buf != NULL) {
-          memcpy(buf, client->send_buffer + total_bytes_sent, total_size);
-          memcpy(buf + total_size, frame, size);
-          free(client->send_buffer);
-          client->send_buffer = buf;
-          client->send_start = total_bytes_sent = 0;
-          client->send_buffer_size = total_size + size;
+        buf = realloc(client->send_buffer, capacity);
+        if (buf == NULL) {
+          perror("realloc");
+          return false;
         }
+        client->send_buffer = buf;
+        client->send_buffer_capacity = capacity;
       }
-      total_size = client->send_buffer_size;
+      memcpy(client->send_buffer + total_size, frame, size);
+      client->send_buffer_size = total_size = total_size + size;
     }
     buf = client->send_buffer;
   } else {
@@ -353,8 +703,10 @@ bool send_frame(Client *client, uint8_t *frame, uint64_t size) {
     total_bytes_sent = 0;
   }
 
+  // With TCP_NOTSENT_LOWAT, send fails with EAGAIN once the kernel has enough unsent data queued. The rest stays in the
+  // send buffer until EPOLLOUT reports that the queue drained below the mark.
   while (total_size > total_bytes_sent) {
-    bytes_sent = send(client->socketfd, buf + total_bytes_sent, total_size - total_bytes_sent, 0);
+    bytes_sent = socket_send(client->socketfd, buf + total_bytes_sent, total_size - total_bytes_sent);
     if (bytes_sent == 0) {
       return false;
     }
@@ -372,7 +724,13 @@ bool send_frame(Client *client, uint8_t *frame, uint64_t size) {
     client->send_buffer = NULL;
     client->send_start = 0;
     client->send_buffer_size = 0;
-    set_write_notify(client->socketfd, false);
+    client->send_buffer_capacity = 0;
+    client->send_frame_end = 0;
+    client->send_control_end = 0;
+    client->pong_size = 0;
+    // A client with pending messages or waiting for the writable handler keeps write notifications, so the loop
+    // reports the drain and takes care of them
+    set_write_notify(client->socketfd, client->pending_head != NULL || client->is_send_blocked);
     return true;
   }
 
@@ -382,7 +740,9 @@ bool send_frame(Client *client, uint8_t *frame, uint64_t size) {
     } else {
       set_write_notify(client->socketfd, true);
       client->send_start = 0;
-      client->send_buffer_size = total_size - total_bytes_sent;
+      client->send_buffer_size = client->send_buffer_capacity = total_size - total_bytes_sent;
+      // The buffer starts with what's left of a single frame. Control frames can go ahead of it if none of it was sent.
+      client->send_frame_end = client->send_control_end = (total_bytes_sent == 0) ? 0 : client->send_buffer_size;
       client->send_buffer = malloc(client->send_buffer_size);
       memcpy(client->send_buffer, buf + total_bytes_sent, total_size - total_bytes_sent);
     }
@@ -6,6 +6,140 @@
 #define NITROWS_SRC_SERVER_H
 
 #include "clients.h"
+#include "queue.h"
+
+/**
+ * Timeouts of a connection in milliseconds. 0 disables a timeout.
+ */
+typedef struct Timeouts Timeouts;
+
+struct Timeouts {
+  // Time from accepting a connection to completing its handshake
+  uint32_t handshake;
+
+  // Time a connected client can go without sending anything
+  uint32_t idle;
+
+  // Time a client has to answer our close frame
+  uint32_t close;
+};
+
+static Timeouts timeouts = {HANDSHAKE_TIMEOUT, 0, CLOSE_TIMEOUT};
+
+/**
+ * Pings sent to every client to detect dead connections and measure their round trip time.
+ */
+typedef struct Heartbeat Heartbeat;
+
+struct Heartbeat {
+  // Milliseconds between pings. 0 disables the heartbeat.
+  uint32_t interval;
+
+  // Number of pings a client can leave unanswered before it's closed
+  uint8_t max_missed_pongs;
+};
+
+static Heartbeat heartbeat = {0, MAX_MISSED_PONGS};
+
+/**
+ * Limits on the bytes queued in a client's send buffer, waiting for a slow reader. 0 disables them.
+ */
+typedef struct SendWatermarks SendWatermarks;
+
+struct SendWatermarks {
+  // Messages are refused while the send buffer holds data and queuing them would take it past this size
+  uint64_t high;
+
+  // Size the send buffer has to drain to before the application is told it can send again
+  uint64_t low;
+};
+
+static SendWatermarks send_watermarks = {SEND_HIGH_WATERMARK, SEND_LOW_WATERMARK};
+
+typedef enum QueuedAction QueuedAction;
+
+// What the event loop does with a queued entry. QUEUED_READ reads from a client once it's resumed.
+enum QueuedAction { QUEUED_SEND = 0, QUEUED_CLOSE, QUEUED_PAUSE_READING, QUEUED_RESUME_READING, QUEUED_READ };
+
+/**
+ * A message queued by another thread to be sent by the event loop. The message is copied right behind it. An entry
+ * can also carry an action on the client instead of a message.
+ */
+typedef struct QueuedMessage QueuedMessage;
+
+struct QueuedMessage {
+  QueueNode node;  // Must be first, so a popped node is the message
+  int socketfd;
+  uint64_t generation;  // Generation of the client it's for, 0 for whichever client has the socket
+  QueuedAction action;
+  uint64_t key;         // Conflation key of the message, 0 if it has none
+  uint64_t expires_at;  // get_time_ms time the message expires at, 0 if it never does
+  Opcode type;
+  uint64_t length;
+  uint8_t data[];
+};
+
+// Messages queued by other threads. It's initialized statically, so messages can be queued before the loop runs.
+static MPSCQueue send_queue = {&send_queue.stub, &send_queue.stub, {NULL}, false};
+
+/**
+ * Get the connection timeouts
+ *
+ * @returns timeouts
+ */
+Timeouts *get_timeouts();
+
+/**
+ * Get the heartbeat settings
+ *
+ * @returns heartbeat settings
+ */
+Heartbeat *get_heartbeat();
+
+/**
+ * Get the send buffer watermarks
+ *
+ * @returns watermarks
+ */
+SendWatermarks *get_send_watermarks();
+
+/**
+ * Get the number of bytes waiting in a client's send buffer and behind it.
+ *
+ * @param client Connected client
+ *
+ * @returns queued bytes
+ */
+uint64_t get_queued_bytes(Client *client);
+
+/**
+ * Check if a message would take a client's send buffer past the high watermark. If it would, the client is marked so
+ * the writable handler runs once the buffer drains. A message always fits an empty buffer, however large it is.
+ *
+ * @param client Connected client
+ * @param size Message size
+ *
+ * @returns true if the message has to be refused, else false
+ */
+bool is_over_high_watermark(Client *client, uint64_t size);
+
+/**
+ * Start sending heartbeat pings to a newly connected client, if the heartbeat is enabled.
+ *
+ * @param client Connected client
+ */
+void start_heartbeat(Client *client);
+
+/**
+ * Handle a pong from a client. A pong answering a heartbeat ping the client can still answer records its round trip
+ * time. Other pongs are ignored.
+ *
+ * @param client Connected client
+ * @param data Unmasked pong payload
+ * @param size Payload size
+ */
+void handle_pong(Client *client, uint8_t *data, uint64_t size);
+
 /**
  * A generic function that will handle connection from clients. Socket desc owned by a client in the table will be
  * handled by data frame function, those that are aren't will have their connection upgraded. It sends data from the
@@ -17,6 +151,13 @@
  */
 void handle_connection(int socketfd, bool is_send, bool is_close);
 
+/**
+ * Close a connection and stop watching it
+ *
+ * @param socketfd Socket descriptor
+ */
+void close_connection(int socketfd);
+
 /**
  * Send http error response and close the connection
  *
@@ -41,6 +182,25 @@ void handle_upgrade(int socketfd);
  */
 void close_client(Client *client);
 
+/**
+ * Wait for a client to answer the close frame sent to it. The client is closed if it doesn't answer in time.
+ *
+ * @param client Connected client
+ */
+void wait_for_close(Client *client);
+
+/**
+ * Parse data received from a client into frames and handle every complete frame. The client is closed if the data is
+ * invalid.
+ *
+ * @param client Connected client
+ * @param buf Data received from the client
+ * @param nbytes Length of data
+ *
+ * @returns false if the client was closed, else true
+ */
+bool process_client_data(Client *client, uint8_t *buf, int nbytes);
+
 /**
  * Handles from a client. This is only for clients that are in our connection table.
  *
@@ -48,6 +208,84 @@ void close_client(Client *client);
  */
 void handle_client_data(Client *client);
 
+/**
+ * Queue a message to be sent to a client by the event loop. Safe to call from any thread.
+ *
+ * @param socketfd Socket for the client receiving the message
+ * @param generation Generation of the client. It's dropped if that client is gone. 0 sends it to whichever client has
+ * the socket.
+ * @param message Message to send. It's copied.
+ * @param length Message length
+ * @param type TEXT or BINARY
+ *
+ * @returns false if memory for the copy can't be allocated, else true
+ */
+bool queue_message(int socketfd, uint64_t generation, uint8_t *message, uint64_t length, Opcode type);
+
+/**
+ * Queue a message that can be conflated to be sent to a client by the event loop. Safe to call from any thread.
+ *
+ * @param socketfd Socket for the client receiving the message
+ * @param generation Generation of the client, like with queue_message
+ * @param key Messages with the same key replace each other while they wait to be sent. 0 is never replaced.
+ * @param expires_at get_time_ms time the message is dropped at if it hasn't been sent. 0 never expires.
+ * @param message Message to send. It's copied.
+ * @param length Message length
+ * @param type TEXT or BINARY
+ *
+ * @returns false if memory for the copy can't be allocated, else true
+ */
+bool queue_conflated_message(int socketfd, uint64_t generation, uint64_t key, uint64_t expires_at, uint8_t *message,
+                             uint64_t length, Opcode type);
+
+/**
+ * Queue an action on a client for the event loop, e.g to start closing it. Safe to call from any thread.
+ *
+ * @param socketfd Socket for the client
+ * @param generation Generation of the client, like with queue_message
+ * @param action Any action but QUEUED_SEND
+ *
+ * @returns false if memory can't be allocated, else true
+ */
+bool queue_action(int socketfd, uint64_t generation, QueuedAction action);
+
+/**
+ * Stop reading from a client. Its data stays in the kernel, so once the socket buffer fills up, TCP flow control
+ * holds the client back. Data already read is still handled. Its idle timeout and heartbeat stop until it's resumed.
+ *
+ * @param client Connected client
+ */
+void pause_reading(Client *client);
+
+/**
+ * Read from a paused client again. The read happens once the loop is done with the current event, since data that
+ * arrived while the client was paused won't be reported by an edge triggered loop.
+ *
+ * @param client Connected client
+ *
+ * @returns false if the read can't be queued, else true
+ */
+bool resume_reading(Client *client);
+
+/**
+ * Send messages queued by other threads and run the queued actions. At most SEND_QUEUE_BATCH_SIZE are handled at once.
+ * If more are left, the loop is woken up again to handle them after the sockets that are ready.
+ */
+void send_queued_messages();
+
+/**
+ * Send a control frame to a client at the next frame boundary, ahead of the data frames in its send buffer that haven't
+ * started. A pong replaces one that hasn't started, so a client flooding pings gets the latest answered. A close frame
+ * drops the data behind it, since nothing can be sent after it.
+ *
+ * @param client Connected client
+ * @param frame Control frame
+ * @param size Control frame size
+ *
+ * @returns true is successful, else false
+ */
+bool send_control_frame(Client *client, uint8_t *frame, uint8_t size);
+
 /**
  * Send a frame to a client.
  *
@@ -1,11 +1,18 @@
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "header.h"
 #include "nitrows.h"
+#include "queue.h"
+#include "timer.h"
+#include "utf8.h"
 
-void echo_message(int client_id, uint8_t *message, uint64_t length) {
-  bool is_sent = nitrows_send_message(client_id, message, length);
-  if (!is_sent) {
+void echo_message(int client_id, uint8_t *message, uint64_t length, void *userdata) {
+  Send_status status = nitrows_send_message(client_id, message, length);
+  if (status == SEND_FAILED) {
     nitrows_close(client_id);
   }
 }
@@ -14,16 +21,309 @@ int test_extension_parser() {
   char tokens[] = "foo,bar;baz,foo;baz";
   char tokens1[] = "foo;bar;baz=1;bar=2";
   char tokens2[] = "bar;quote=\"10\",gaga";
-  ExtensionList *list = get_extension_list(1);
-  parse_extensions(1, tokens, list);
-  parse_extensions(1, tokens1, list);
-  parse_extensions(1, tokens2, list);
+  uint8_t arena_buffer[HANDSHAKE_ARENA_SIZE];
+  Arena arena;
+  arena_init(&arena, arena_buffer, sizeof(arena_buffer));
+  ExtensionList *list = create_extension_list(&arena);
+  parse_extensions(1, tokens, list, &arena);
+  parse_extensions(1, tokens1, list, &arena);
+  parse_extensions(1, tokens2, list, &arena);
   printf("Testing tokens: %s\n", tokens);
   print_list(list);
+  arena_release(&arena);
   return 0;
 }
 
-int main() {
+/**
+ * Report a failed check.
+ *
+ * @returns 0 if the check passed, else 1
+ */
+int check(bool is_passed, const char *what) {
+  if (!is_passed) {
+    printf("FAILED: %s\n", what);
+  }
+  return is_passed ? 0 : 1;
+}
+
+/**
+ * Validate a string in up to three chunks split at first and second.
+ *
+ * @returns true if every chunk was accepted, with the final DFA state in state
+ */
+bool __validate_in_chunks(uint8_t *state, const char *str, size_t length, size_t first, size_t second) {
+  const uint8_t *bytes = (const uint8_t *)str;
+  *state = UTF8_ACCEPT;
+  return validate_utf8_chunk(state, bytes, first) && validate_utf8_chunk(state, bytes + first, second - first) &&
+         validate_utf8_chunk(state, bytes + second, length - second);
+}
+
+int test_utf8_chunks() {
+  // 1, 2, 3 and 4 byte code points
+  const char valid[] = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80z";
+  size_t length = sizeof(valid) - 1;
+  // A split in the middle of a code point that's wrong past the split
+  const char *invalid[] = {"\xe2\x82" "A", "\xf0\x9f\x98" "A", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80"};
+  uint8_t state;
+  int failures = 0;
+  for (size_t first = 0; first <= length; first++) {
+    for (size_t second = first; second <= length; second++) {
+      failures += check(__validate_in_chunks(&state, valid, length, first, second) && state == UTF8_ACCEPT,
+                        "code points split across chunks are valid");
+    }
+    // A message that ends in the middle of a code point isn't rejected chunk by chunk, but doesn't end accepted
+    bool is_complete = first == 0 || first == 1 || first == 3 || first == 6 || first == 10 || first == 11;
+    failures += check(__validate_in_chunks(&state, valid, first, first, first), "a prefix isn't rejected early");
+    failures += check((state == UTF8_ACCEPT) == is_complete, "a message ending mid code point isn't accepted");
+  }
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    length = strlen(invalid[i]);
+    for (size_t first = 0; first <= length; first++) {
+      failures += check(!__validate_in_chunks(&state, invalid[i], length, first, length), "invalid code points");
+    }
+  }
+  printf("Testing UTF-8 chunks: %s\n", failures == 0 ? "ok" : "failed");
+  return failures;
+}
+
+typedef struct TestTimer TestTimer;
+
+struct TestTimer {
+  Timer timer;
+  uint64_t expires;   // Tick it should run on
+  int run_count;      // Times it ran
+  int restart_count;  // Times it starts itself again when it runs
+};
+
+// Time of the clock the timer wheel runs on in test_timer_wheel, and its time on the previous run_timers
+static uint64_t test_clock;
+static uint64_t previous_test_clock;
+// The clock is only moved to ticks with work, so timers have to run right on their tick
+static bool is_clock_exact;
+// Latest tick a test timer expired on, to check they run in order
+static uint64_t last_expires;
+// Timers that ran out of order, before they expired or later than the first run_timers after they expired
+static int out_of_order_count;
+static int early_count;
+static int late_count;
+
+uint64_t __get_test_clock() { return test_clock; }
+
+void __run_test_timer(Timer *timer, void *data) {
+  TestTimer *test_timer = (TestTimer *)data;
+  if (test_timer->expires < last_expires) {
+    out_of_order_count++;
+  }
+  if (test_timer->expires > test_clock) {
+    early_count++;
+  }
+  if (test_timer->expires <= previous_test_clock || (is_clock_exact && test_timer->expires != test_clock)) {
+    late_count++;
+  }
+  last_expires = test_timer->expires;
+  test_timer->run_count++;
+  if (test_timer->restart_count > 0) {
+    test_timer->restart_count--;
+    test_timer->expires = test_clock + 4096;
+    start_timer(timer, 4096, __run_test_timer, test_timer);
+  }
+}
+
+/**
+ * Start a batch of timers at the current time of the test clock, with timeouts at and around the boundaries of every
+ * level and past the furthest the wheel reaches.
+ *
+ * @returns number of timers started
+ */
+int __start_test_timers(TestTimer *timers) {
+  const uint64_t timeouts[] = {0, 1, 2, 63, 64, 65, 127, 128, 4094, 4095, 4096, 4097, 262143, 262144, 262145,
+                               TIMER_MAX_TICKS - 1, TIMER_MAX_TICKS, TIMER_MAX_TICKS + 1, TIMER_MAX_TICKS + 5,
+                               2 * TIMER_MAX_TICKS + 100, 3 * (TIMER_MAX_TICKS + 1) + 7};
+  int count = sizeof(timeouts) / sizeof(timeouts[0]);
+  memset(timers, 0, sizeof(TestTimer) * count);
+  for (int i = 0; i < count; i++) {
+    // The current tick already ran, so a timeout of 0 runs on the next one
+    timers[i].expires = test_clock + (timeouts[i] == 0 ? 1 : timeouts[i]);
+    start_timer(&timers[i].timer, timeouts[i], __run_test_timer, &timers[i]);
+  }
+  return count;
+}
+
+int test_timer_wheel() {
+  TestTimer timers[64];
+  TestTimer stopped;
+  int failures = 0;
+  int count = 0;
+  bool is_done = false;
+  set_timer_clock(__get_test_clock);
+
+  // Stepping the clock by the timeout the event loop would wait, every timer runs right on its tick. The batches start
+  // just before the end of a turn of level 2 and at an odd time in the middle of a turn.
+  test_clock = previous_test_clock = (UINT64_C(1) << 18) - 3;
+  is_clock_exact = true;
+  last_expires = 0;
+  out_of_order_count = early_count = late_count = 0;
+  count = __start_test_timers(timers);
+  timers[0].restart_count = 5;
+  memset(&stopped, 0, sizeof(stopped));
+  start_timer(&stopped.timer, 2 * TIMER_MAX_TICKS, __run_test_timer, &stopped);
+  stop_timer(&stopped.timer);
+  // The wheel only stops at ticks with work, which are far fewer than this
+  for (int step = 0; step < 100000 && !is_done; step++) {
+    int timeout = get_timer_timeout();
+    if (timeout < 0) {
+      break;
+    }
+    // The second batch starts at the first step past its start time, which isn't a boundary of any level
+    if (count < 32 && test_clock + timeout > (UINT64_C(1) << 18) + 100000) {
+      previous_test_clock = test_clock;
+      test_clock = (UINT64_C(1) << 18) + 100000 + 37;
+      is_clock_exact = false;
+      run_timers();
+      is_clock_exact = true;
+      count += __start_test_timers(timers + count);
+      continue;
+    }
+    previous_test_clock = test_clock;
+    test_clock += (timeout > 0) ? timeout : 1;
+    run_timers();
+    is_done = true;
+    for (int i = 0; i < count; i++) {
+      is_done = is_done && timers[i].run_count > 0 && !timers[i].timer.is_active;
+    }
+  }
+  failures += check(is_done, "every timer runs");
+  for (int i = 0; i < count; i++) {
+    failures += check(timers[i].run_count == (i == 0 ? 6 : 1), "a timer runs once each time it's started");
+  }
+  failures += check(stopped.run_count == 0, "a stopped timer doesn't run");
+  failures += check(out_of_order_count == 0, "timers run in order");
+  failures += check(early_count == 0 && late_count == 0, "a timer runs on its tick");
+
+  // Moving the clock by large steps, every timer that expired in between runs in order on the next run_timers. The
+  // wheel starts over at the new time.
+  test_clock = (UINT64_C(1) << 24) - 1000;
+  set_timer_clock(__get_test_clock);
+  is_clock_exact = false;
+  last_expires = 0;
+  out_of_order_count = early_count = late_count = 0;
+  count = __start_test_timers(timers);
+  for (uint64_t step = 1; test_clock < timers[count - 1].expires + 1000000; step++) {
+    previous_test_clock = test_clock;
+    test_clock += (step * 7919) % 1000003 + 1;
+    run_timers();
+  }
+  for (int i = 0; i < count; i++) {
+    failures += check(timers[i].run_count == 1, "a timer runs once");
+  }
+  failures += check(out_of_order_count == 0, "timers run in order");
+  failures += check(early_count == 0 && late_count == 0, "a timer runs on the first run after it expired");
+  failures += check(get_timer_timeout() == -1, "no timers are left");
+
+  set_timer_clock(NULL);
+  printf("Testing timer wheel: %s\n", failures == 0 ? "ok" : "failed");
+  return failures;
+}
+
+#define TEST_PRODUCERS 4
+#define TEST_PUSHES 200000
+
+typedef struct TestNode TestNode;
+
+struct TestNode {
+  QueueNode node;  // Must be first, so a popped node is the test node
+  int producer;
+  int sequence;
+};
+
+typedef struct TestProducer TestProducer;
+
+struct TestProducer {
+  MPSCQueue *queue;
+  TestNode *nodes;
+  int index;
+};
+
+// Producers that pushed all their nodes
+static int finished_producers;
+
+void *__run_test_producer(void *arg) {
+  TestProducer *producer = (TestProducer *)arg;
+  for (int i = 0; i < TEST_PUSHES; i++) {
+    producer->nodes[i].producer = producer->index;
+    producer->nodes[i].sequence = i;
+    queue_push(producer->queue, &producer->nodes[i].node);
+  }
+  __atomic_add_fetch(&finished_producers, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int test_mpsc_queue() {
+  MPSCQueue queue;
+  TestNode single[2];
+  int failures = 0;
+  queue_init(&queue);
+
+  // One node at a time, the stub is pushed behind it so it can be popped
+  failures += check(queue_pop(&queue) == NULL, "an empty queue pops nothing");
+  failures += check(queue_push(&queue, &single[0].node), "the first push wakes the consumer");
+  failures += check(!queue_push(&queue, &single[1].node), "a push before the signal is cleared doesn't");
+  queue_clear_signal(&queue);
+  failures += check(queue_pop(&queue) == &single[0].node, "nodes pop in order");
+  failures += check(queue_pop(&queue) == &single[1].node, "the last node pops");
+  failures += check(queue_pop(&queue) == NULL, "a drained queue pops nothing");
+  failures += check(queue_push(&queue, &single[0].node), "a push after the signal is cleared wakes the consumer");
+  failures += check(queue_pop(&queue) == &single[0].node && queue_pop(&queue) == NULL, "the queue is reused");
+
+  // Producers push while the consumer pops. A pop can come back empty while a push is in flight, so the consumer keeps
+  // going until every push is done. A node that's lost never pops.
+  TestProducer producers[TEST_PRODUCERS];
+  pthread_t threads[TEST_PRODUCERS];
+  int next_sequence[TEST_PRODUCERS] = {0};
+  int popped = 0;
+  int out_of_order = 0;
+  bool is_pushed = false;
+  finished_producers = 0;
+  queue_init(&queue);
+  for (int i = 0; i < TEST_PRODUCERS; i++) {
+    producers[i].queue = &queue;
+    producers[i].index = i;
+    producers[i].nodes = (TestNode *)malloc(sizeof(TestNode) * TEST_PUSHES);
+    pthread_create(&threads[i], NULL, __run_test_producer, &producers[i]);
+  }
+  QueueNode *node = NULL;
+  while (!is_pushed) {
+    is_pushed = __atomic_load_n(&finished_producers, __ATOMIC_ACQUIRE) == TEST_PRODUCERS;
+    queue_clear_signal(&queue);
+    while ((node = queue_pop(&queue)) != NULL) {
+      TestNode *test_node = (TestNode *)node;
+      if (test_node->sequence != next_sequence[test_node->producer]) {
+        out_of_order++;
+      }
+      next_sequence[test_node->producer] = test_node->sequence + 1;
+      popped++;
+    }
+  }
+  for (int i = 0; i < TEST_PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+    failures += check(next_sequence[i] == TEST_PUSHES, "the last node of a producer pops");
+    free(producers[i].nodes);
+  }
+  failures += check(popped == TEST_PRODUCERS * TEST_PUSHES, "every node pops");
+  failures += check(out_of_order == 0, "the nodes of a producer pop in order");
+  failures += check(queue_pop(&queue) == NULL, "nothing pops after the last node");
+  printf("Testing MPSC queue: %s\n", failures == 0 ? "ok" : "failed");
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  // "nitrows test" runs the tests, else it's an echo server
+  if (argc > 1 && strcmp(argv[1], "test") == 0) {
+    int failures = test_utf8_chunks();
+    failures += test_timer_wheel();
+    failures += test_mpsc_queue();
+    return failures == 0 ? 0 : 1;
+  }
   nitrows_set_message_handler(echo_message);
   nitrows_run();
 }
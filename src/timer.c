@@ -0,0 +1,208 @@
+#include "timer.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+
+// The wheel every timer of the process is on. The event loop is its only user.
+static TimerWheel timer_wheel;
+
+// Clock the wheel runs on
+static uint64_t (*timer_clock)() = get_time_ms;
+
+uint64_t get_time_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t get_time_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Rotate the occupied bits of a level so the bit of a given slot becomes bit 0.
+ */
+uint64_t __rotate_slots(uint64_t occupied, uint8_t slot) {
+  return (slot == 0) ? occupied : (occupied >> slot) | (occupied << (TIMER_SLOTS - slot));
+}
+
+/**
+ * Link a timer into the slot it belongs to for its expiry tick. The expiry tick mustn't be before the current tick.
+ */
+void __add_timer(Timer *timer) {
+  TimerWheel *wheel = &timer_wheel;
+  uint64_t expires = timer->expires;
+  uint64_t delta = expires - wheel->current_tick;
+  // Timers further away than the wheel reaches are parked in the top level and placed again when they're moved down
+  if (delta > TIMER_MAX_TICKS) {
+    expires = wheel->current_tick + TIMER_MAX_TICKS;
+    delta = TIMER_MAX_TICKS;
+  }
+  uint8_t level = 0;
+  while (level < TIMER_LEVELS - 1 && delta >= (UINT64_C(1) << (TIMER_SLOT_BITS * (level + 1)))) {
+    level++;
+  }
+  uint8_t slot = (expires >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK;
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = wheel->slots[level][slot];
+  if (timer->next != NULL) {
+    timer->next->prev = timer;
+  }
+  wheel->slots[level][slot] = timer;
+  wheel->occupied[level] |= UINT64_C(1) << slot;
+  timer->is_active = true;
+}
+
+/**
+ * Unlink a running timer from its slot.
+ */
+void __remove_timer(Timer *timer) {
+  TimerWheel *wheel = &timer_wheel;
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    wheel->slots[timer->level][timer->slot] = timer->next;
+  }
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+  if (wheel->slots[timer->level][timer->slot] == NULL) {
+    wheel->occupied[timer->level] &= ~(UINT64_C(1) << timer->slot);
+  }
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->is_active = false;
+}
+
+/**
+ * Move the timers of a slot down to the levels they now belong to. Called when the current tick reaches the start of
+ * the time the slot covers.
+ */
+void __cascade_timers(uint8_t level, uint8_t slot) {
+  TimerWheel *wheel = &timer_wheel;
+  Timer *timer = wheel->slots[level][slot];
+  Timer *next = NULL;
+  wheel->slots[level][slot] = NULL;
+  wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+  while (timer != NULL) {
+    next = timer->next;
+    __add_timer(timer);
+    timer = next;
+  }
+}
+
+/**
+ * Find the next tick with work, either a level 0 slot with timers or the start of a higher level slot with timers
+ * that have to be moved down.
+ *
+ * @returns the tick. UINT64_MAX if there are no timers.
+ */
+uint64_t __get_next_tick() {
+  TimerWheel *wheel = &timer_wheel;
+  uint64_t next = UINT64_MAX;
+  for (uint8_t level = 0; level < TIMER_LEVELS; level++) {
+    if (wheel->occupied[level] == 0) {
+      continue;
+    }
+    // Slots are searched from the one after the current one. The current slot of a level above 0 can still hold timers
+    // a whole turn of the level ahead, which expire after those of every other slot, so it's searched last.
+    uint8_t shift = TIMER_SLOT_BITS * level;
+    uint64_t period = (wheel->current_tick >> shift) + 1;
+    uint64_t rotated = __rotate_slots(wheel->occupied[level], period & TIMER_SLOT_MASK);
+    uint64_t tick = (period + __builtin_ctzll(rotated)) << shift;
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
+
+void start_timer(Timer *timer, uint64_t timeout, void (*callback)(Timer *, void *), void *data) {
+  TimerWheel *wheel = &timer_wheel;
+  uint64_t now = timer_clock();
+  if (!wheel->is_initialized) {
+    wheel->current_tick = now;
+    wheel->is_initialized = true;
+  }
+  if (timer->is_active) {
+    __remove_timer(timer);
+  }
+  timer->callback = callback;
+  timer->data = data;
+  // The current tick has already run, so the earliest a timer can expire is the next one
+  timer->expires = now + timeout;
+  if (timer->expires <= wheel->current_tick) {
+    timer->expires = wheel->current_tick + 1;
+  }
+  __add_timer(timer);
+}
+
+void stop_timer(Timer *timer) {
+  if (timer->is_active) {
+    __remove_timer(timer);
+  }
+}
+
+void set_timer_clock(uint64_t (*clock)()) {
+  timer_clock = (clock == NULL) ? get_time_ms : clock;
+  timer_wheel.is_initialized = false;
+}
+
+void run_timers() {
+  TimerWheel *wheel = &timer_wheel;
+  if (!wheel->is_initialized) {
+    return;
+  }
+  uint64_t now = timer_clock();
+  Timer *timer = NULL;
+  while (wheel->current_tick < now) {
+    // Ticks without work are skipped
+    uint64_t tick = __get_next_tick();
+    if (tick > now) {
+      wheel->current_tick = now;
+      break;
+    }
+    wheel->current_tick = tick;
+
+    // At the end of a turn of level 0, the next slot of level 1 is moved down. It might be the end of a turn of
+    // level 1 too, and so on. Higher levels are moved first, since their timers can end up in the lower slots that
+    // are about to be moved.
+    if ((tick & TIMER_SLOT_MASK) == 0) {
+      uint8_t top = 1;
+      while (top < TIMER_LEVELS - 1 && ((tick >> (TIMER_SLOT_BITS * top)) & TIMER_SLOT_MASK) == 0) {
+        top++;
+      }
+      for (uint8_t level = top; level > 0; level--) {
+        __cascade_timers(level, (tick >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK);
+      }
+    }
+
+    // Callbacks can start timers, but never in the slot being run, so it's emptied one timer at a time.
+    uint8_t slot = tick & TIMER_SLOT_MASK;
+    while ((timer = wheel->slots[0][slot]) != NULL) {
+      __remove_timer(timer);
+      timer->callback(timer, timer->data);
+    }
+  }
+}
+
+int get_timer_timeout() {
+  if (!timer_wheel.is_initialized) {
+    return -1;
+  }
+  uint64_t tick = __get_next_tick();
+  if (tick == UINT64_MAX) {
+    return -1;
+  }
+  uint64_t now = timer_clock();
+  if (tick <= now) {
+    return 0;
+  }
+  return (tick - now > INT_MAX) ? INT_MAX : (int)(tick - now);
+}
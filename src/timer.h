@@ -0,0 +1,97 @@
+/**
+ * Hierarchical timer wheel. Timers are kept in 4 levels of 64 slots. A level 0 slot covers a single tick of 1ms and a
+ * slot of each level above covers a whole turn of the level below. Starting, stopping and expiring a timer are O(1),
+ * so every connection can have its own timeouts. Timers far in the future are moved down a level each time the level
+ * below them completes a turn.
+ *
+ * Timers are intrusive. The owner provides the memory, which mustn't move or be freed while the timer is running.
+ */
+#ifndef NITROWS_SRC_TIMER_H
+#define NITROWS_SRC_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+// Longest timeout in ticks the wheel holds without moving the timer back to the top level, about 4.6 hours
+#define TIMER_MAX_TICKS ((UINT64_C(1) << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+typedef struct timer Timer;
+
+struct timer {
+  Timer *next;
+  Timer *prev;
+  uint64_t expires;  // Tick the timer expires on
+  void (*callback)(Timer *, void *);
+  void *data;  // Passed to the callback
+  uint8_t level;
+  uint8_t slot;
+  bool is_active;
+};
+
+typedef struct timer_wheel TimerWheel;
+
+struct timer_wheel {
+  uint64_t current_tick;  // Last tick whose timers have run
+  bool is_initialized;
+  uint64_t occupied[TIMER_LEVELS];  // Bit i is set if slot i of the level holds timers
+  Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/**
+ * Get the current time of the monotonic clock in milliseconds, the unit of a tick.
+ *
+ * @returns current time
+ */
+uint64_t get_time_ms();
+
+/**
+ * Get the current time of the monotonic clock in microseconds.
+ *
+ * @returns current time
+ */
+uint64_t get_time_us();
+
+/**
+ * Start a timer. A running timer is restarted.
+ *
+ * @param timer Timer to start. It must be zeroed before it's started the first time.
+ * @param timeout Milliseconds until the timer expires
+ * @param callback Function run when the timer expires. It receives the timer and data. It can start or stop any timer,
+ * including the one that expired.
+ * @param data Passed to the callback
+ */
+void start_timer(Timer *timer, uint64_t timeout, void (*callback)(Timer *, void *), void *data);
+
+/**
+ * Stop a timer. Nothing happens if it isn't running.
+ *
+ * @param timer Timer to stop
+ */
+void stop_timer(Timer *timer);
+
+/**
+ * Replace the clock the timers run on, so tests can drive them. The wheel starts over at the new clock's time, so it
+ * can only be replaced while no timer is running.
+ *
+ * @param clock Function returning the current time in milliseconds. NULL goes back to get_time_ms.
+ */
+void set_timer_clock(uint64_t (*clock)());
+
+/**
+ * Run the callbacks of every timer that has expired.
+ */
+void run_timers();
+
+/**
+ * Get how long the event loop can wait before a timer needs attention.
+ *
+ * @returns milliseconds until the next timer expires or has to be moved down a level. -1 if there are no timers.
+ */
+int get_timer_timeout();
+
+#endif
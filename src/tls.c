@@ -0,0 +1,217 @@
+#include "tls.h"
+
+#ifdef NITROWS_TLS
+#include <errno.h>
+#include <limits.h>
+#include <openssl/err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "events.h"
+
+bool init_tls(char *certificate_file, char *key_file) {
+  SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+  if (context == NULL) {
+    ERR_print_errors_fp(stderr);
+    return false;
+  }
+  SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+  // Clients often close the connection without a close_notify once the websocket is closed. It's treated as a close.
+  SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+  // Sessions that stay in OpenSSL behave like non-blocking sockets. send_frame resends the rest of a partial write
+  // from wherever the send buffer holds it.
+  SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if (SSL_CTX_use_certificate_chain_file(context, certificate_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(context, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(context) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(context);
+    return false;
+  }
+  if (tls_sessions.context != NULL) {
+    SSL_CTX_free(tls_sessions.context);
+  }
+  tls_sessions.context = context;
+  // OpenSSL writes to the socket with plain write calls, which raise SIGPIPE once a client resets the connection. It's
+  // ignored so the failed write is handled like any other, unless the application set its own handler.
+  struct sigaction action;
+  if (sigaction(SIGPIPE, NULL, &action) == 0 && action.sa_handler == SIG_DFL) {
+    signal(SIGPIPE, SIG_IGN);
+  }
+  return true;
+}
+
+bool is_tls_enabled() { return tls_sessions.context != NULL; }
+
+/**
+ * Get the OpenSSL session of a connection.
+ *
+ * @returns session. NULL if the connection has none.
+ */
+SSL *__get_session(int socketfd) {
+  return (socketfd >= 0 && socketfd < tls_sessions.capacity) ? tls_sessions.sessions[socketfd] : NULL;
+}
+
+bool start_tls(int socketfd) {
+  if (socketfd >= tls_sessions.capacity) {
+    int capacity = tls_sessions.capacity > 0 ? tls_sessions.capacity : INITIAL_EVENT_SIZE;
+    while (capacity <= socketfd) {
+      capacity *= 2;
+    }
+    SSL **sessions = (SSL **)realloc(tls_sessions.sessions, sizeof(SSL *) * capacity);
+    if (sessions == NULL) {
+      perror("realloc");
+      return false;
+    }
+    memset(sessions + tls_sessions.capacity, 0, sizeof(SSL *) * (capacity - tls_sessions.capacity));
+    tls_sessions.sessions = sessions;
+    size_t *pending_write_sizes = (size_t *)realloc(tls_sessions.pending_write_sizes, sizeof(size_t) * capacity);
+    if (pending_write_sizes == NULL) {
+      perror("realloc");
+      return false;
+    }
+    memset(pending_write_sizes + tls_sessions.capacity, 0, sizeof(size_t) * (capacity - tls_sessions.capacity));
+    tls_sessions.pending_write_sizes = pending_write_sizes;
+    tls_sessions.capacity = capacity;
+  }
+  SSL *ssl = SSL_new(tls_sessions.context);
+  if (ssl == NULL || SSL_set_fd(ssl, socketfd) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_free(ssl);
+    return false;
+  }
+  SSL_set_accept_state(ssl);
+  tls_sessions.sessions[socketfd] = ssl;
+  tls_sessions.pending_write_sizes[socketfd] = 0;
+  return true;
+}
+
+bool is_tls_handshake_pending(int socketfd) {
+  SSL *ssl = __get_session(socketfd);
+  return ssl != NULL && !SSL_is_init_finished(ssl);
+}
+
+/**
+ * Free the session of a connection once the kernel handles both of its directions, unless OpenSSL still holds records
+ * it read or a write it couldn't finish. Those would be lost, so the session is kept until they're done with.
+ */
+void __release_session(int socketfd, SSL *ssl) {
+#ifndef OPENSSL_NO_KTLS
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl) &&
+      tls_sessions.pending_write_sizes[socketfd] == 0) {
+    SSL_free(ssl);
+    tls_sessions.sessions[socketfd] = NULL;
+  }
+#endif
+}
+
+TlsHandshakeStatus continue_tls_handshake(int socketfd) {
+  SSL *ssl = __get_session(socketfd);
+  if (ssl == NULL) {
+    return TLS_HANDSHAKE_FAILED;
+  }
+  ERR_clear_error();
+  int result = SSL_do_handshake(ssl);
+  if (result != 1) {
+    switch (SSL_get_error(ssl, result)) {
+      case SSL_ERROR_WANT_READ:
+        return TLS_HANDSHAKE_PENDING;
+      case SSL_ERROR_WANT_WRITE:
+        // Our flight didn't fit in the socket buffer. The handshake goes on once the socket is writable.
+        set_write_notify(socketfd, true);
+        return TLS_HANDSHAKE_PENDING;
+      default:
+        ERR_print_errors_fp(stderr);
+        return TLS_HANDSHAKE_FAILED;
+    }
+  }
+  set_write_notify(socketfd, false);
+
+  // OpenSSL switches each direction to kernel TLS on its own if it can. Once both are, the socket reads and writes
+  // plaintext and the session isn't needed anymore. A client can send its first records right behind its Finished,
+  // and OpenSSL may have read them already.
+  __release_session(socketfd, ssl);
+  return TLS_HANDSHAKE_DONE;
+}
+
+void close_tls(int socketfd) {
+  SSL *ssl = __get_session(socketfd);
+  if (ssl != NULL) {
+    SSL_free(ssl);
+    tls_sessions.sessions[socketfd] = NULL;
+    tls_sessions.pending_write_sizes[socketfd] = 0;
+  }
+}
+
+size_t get_pending_write_size(int socketfd) {
+  return (__get_session(socketfd) == NULL) ? 0 : tls_sessions.pending_write_sizes[socketfd];
+}
+
+/**
+ * Turn a failed OpenSSL read or write into what recv or send would have returned.
+ *
+ * @returns 0 if the client closed the connection, else -1 with errno set
+ */
+ssize_t __get_io_result(SSL *ssl, int result) {
+  switch (SSL_get_error(ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      // errno is set by the failed socket call
+      if (errno == 0) {
+        errno = EIO;
+      }
+      return -1;
+    default:
+      ERR_print_errors_fp(stderr);
+      errno = EPROTO;
+      return -1;
+  }
+}
+
+ssize_t socket_recv(int socketfd, void *buffer, size_t length) {
+  SSL *ssl = __get_session(socketfd);
+  if (ssl == NULL) {
+    return recv(socketfd, buffer, length, 0);
+  }
+  ERR_clear_error();
+  errno = 0;
+  int nbytes = SSL_read(ssl, buffer, length > INT_MAX ? INT_MAX : (int)length);
+  if (nbytes <= 0) {
+    return __get_io_result(ssl, nbytes);
+  }
+  __release_session(socketfd, ssl);
+  return nbytes;
+}
+
+ssize_t socket_send(int socketfd, const void *buffer, size_t length) {
+  SSL *ssl = __get_session(socketfd);
+  if (ssl == NULL) {
+    return send(socketfd, buffer, length, SEND_FLAGS);
+  }
+  // Partial writes return after a record anyway. Giving OpenSSL one record at a time keeps the bytes a pending write
+  // holds on to down to that record, so control frames can still go ahead of the data behind it.
+  if (length > SSL3_RT_MAX_PLAIN_LENGTH) {
+    length = SSL3_RT_MAX_PLAIN_LENGTH;
+  }
+  ERR_clear_error();
+  errno = 0;
+  int nbytes = SSL_write(ssl, buffer, (int)length);
+  if (nbytes > 0) {
+    tls_sessions.pending_write_sizes[socketfd] = 0;
+    return nbytes;
+  }
+  ssize_t result = __get_io_result(ssl, nbytes);
+  tls_sessions.pending_write_sizes[socketfd] = (result < 0 && errno == EAGAIN) ? length : 0;
+  return result;
+}
+#endif
@@ -0,0 +1,141 @@
+/**
+ * Optional TLS termination, built with TLS=1. OpenSSL runs the handshake and then hands the session keys to the kernel
+ * (kTLS), so connections are read and written with plain recv and send like unencrypted ones. Where the kernel or
+ * OpenSSL can't take over both directions, the connection keeps its OpenSSL session and its data goes through it.
+ */
+#ifndef NITROWS_SRC_TLS_H
+#define NITROWS_SRC_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// A send to a client that's gone fails with EPIPE instead of raising SIGPIPE, where the system supports it
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+#ifdef NITROWS_TLS
+#include <openssl/ssl.h>
+
+typedef struct TlsSessions TlsSessions;
+
+struct TlsSessions {
+  SSL_CTX *context;  // NULL until a certificate is loaded
+
+  // OpenSSL sessions indexed by socket descriptor. A socket has one while its handshake is running, and afterwards if
+  // kernel TLS doesn't handle both of its directions or OpenSSL still holds data of the connection.
+  SSL **sessions;
+
+  // Size of a write OpenSSL couldn't finish, indexed by socket descriptor, 0 if there's none. It already encrypted the
+  // bytes it was given, so the retry has to start with the same bytes.
+  size_t *pending_write_sizes;
+  int capacity;
+};
+
+static TlsSessions tls_sessions;
+
+typedef enum TlsHandshakeStatus TlsHandshakeStatus;
+
+enum TlsHandshakeStatus { TLS_HANDSHAKE_DONE = 0, TLS_HANDSHAKE_PENDING, TLS_HANDSHAKE_FAILED };
+
+/**
+ * Load the certificate and private key connections are accepted with. TLS is enabled once it succeeds.
+ *
+ * @param certificate_file Path of the PEM certificate chain
+ * @param key_file Path of the PEM private key
+ *
+ * @returns false if the certificate or key can't be loaded, else true
+ */
+bool init_tls(char *certificate_file, char *key_file);
+
+/**
+ * Check if connections are accepted with TLS.
+ *
+ * @returns true if TLS is enabled, else false
+ */
+bool is_tls_enabled();
+
+/**
+ * Create the TLS session of an accepted connection. The handshake runs as the client's data arrives.
+ *
+ * @param socketfd Client socket descriptor
+ *
+ * @returns false if the session can't be created, else true
+ */
+bool start_tls(int socketfd);
+
+/**
+ * Check if a connection is still in its TLS handshake.
+ *
+ * @param socketfd Client socket descriptor
+ *
+ * @returns true if the handshake is running, else false
+ */
+bool is_tls_handshake_pending(int socketfd);
+
+/**
+ * Continue the TLS handshake of a connection with the data that arrived. Once it's done, the session is handed to the
+ * kernel if it can take it. If OpenSSL already read records behind the handshake, it keeps the session until they
+ * are read.
+ *
+ * @param socketfd Client socket descriptor
+ *
+ * @returns TLS_HANDSHAKE_DONE once the handshake is complete, TLS_HANDSHAKE_PENDING if it waits for the socket and
+ * TLS_HANDSHAKE_FAILED if it failed
+ */
+TlsHandshakeStatus continue_tls_handshake(int socketfd);
+
+/**
+ * Free the TLS session of a connection being closed, if it has one.
+ *
+ * @param socketfd Client socket descriptor
+ */
+void close_tls(int socketfd);
+
+/**
+ * Get the size of a write to a connection that OpenSSL couldn't finish. The next send has to start with the same
+ * bytes, so they can't be changed until it's done.
+ *
+ * @param socketfd Client socket descriptor
+ *
+ * @returns number of bytes, 0 if no write is pending
+ */
+size_t get_pending_write_size(int socketfd);
+
+/**
+ * Receive data from a connection. It's decrypted by OpenSSL if the connection has a session, else it's a plain recv.
+ *
+ * @param socketfd Client socket descriptor
+ * @param buffer Buffer to receive into
+ * @param length Buffer size
+ *
+ * @returns number of bytes received, 0 if the connection was closed, -1 on error with errno set like recv
+ */
+ssize_t socket_recv(int socketfd, void *buffer, size_t length);
+
+/**
+ * Send data to a connection. It's encrypted by OpenSSL if the connection has a session, else it's a plain send.
+ *
+ * @param socketfd Client socket descriptor
+ * @param buffer Data to send
+ * @param length Data size
+ *
+ * @returns number of bytes sent, -1 on error with errno set like send
+ */
+ssize_t socket_send(int socketfd, const void *buffer, size_t length);
+#else
+static inline size_t get_pending_write_size(int socketfd) { return 0; }
+
+static inline ssize_t socket_recv(int socketfd, void *buffer, size_t length) {
+  return recv(socketfd, buffer, length, 0);
+}
+
+static inline ssize_t socket_send(int socketfd, const void *buffer, size_t length) {
+  return send(socketfd, buffer, length, SEND_FLAGS);
+}
+#endif
+#endif
@@ -41,22 +41,36 @@ static const uint8_t utf8d[] = {
     1,   3,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  // s7..s8
 };
 
-bool validate_utf8(const char *str, size_t len) {
+/**
+ * Run a chunk of a larger string through the DFA. The state carries over from
+ * the previous chunk, so a code point can be split across chunks. The string
+ * is valid if the state is UTF8_ACCEPT after its last chunk.
+ *
+ * @returns false as soon as the string is known to be invalid.
+ */
+static inline bool validate_utf8_chunk(uint8_t *state, const uint8_t *str, size_t len) {
   size_t i;
   uint32_t type;
-  uint8_t state = UTF8_ACCEPT;
+  uint8_t current = *state;
 
   for (i = 0; i < len; i++) {
     // We don't care about the codepoint, so this is
     // a simplified version of the decode function.
-    type = utf8d[(uint8_t)str[i]];
-    state = utf8d[256 + state * 16 + type];
+    type = utf8d[str[i]];
+    current = utf8d[256 + current * 16 + type];
 
-    if (state == UTF8_REJECT) {
+    if (current == UTF8_REJECT) {
       break;
     }
   }
 
+  *state = current;
+  return current != UTF8_REJECT;
+}
+
+static inline bool validate_utf8(const char *str, size_t len) {
+  uint8_t state = UTF8_ACCEPT;
+  validate_utf8_chunk(&state, (const uint8_t *)str, len);
   return state == UTF8_ACCEPT;
 }
 #endif
\ No newline at end of file
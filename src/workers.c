@@ -0,0 +1,230 @@
+#include "workers.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "handlers.h"
+
+// Set on the worker threads, so calls into the library from handlers can tell they're off the event loop
+static __thread bool is_worker;
+
+// Client the worker is handling a job for
+static __thread int handled_socketfd;
+static __thread uint64_t handled_generation;
+
+// Type of the message the thread is handling. The event loop sets it while it runs a message handler itself.
+static __thread Opcode handled_message_type;
+
+// Number of workers start_workers starts
+static int requested_worker_count;
+
+// Workers that were started, indexed by the socket of the client modulo their count
+static Worker *workers;
+static int worker_count;
+
+void set_worker_count(int count) { requested_worker_count = count; }
+
+bool is_worker_thread() { return is_worker; }
+
+uint64_t get_handled_client_generation(int socketfd) {
+  return (is_worker && socketfd == handled_socketfd) ? handled_generation : 0;
+}
+
+Opcode get_handled_message_type() { return (handled_message_type == TEXT) ? TEXT : BINARY; }
+
+/**
+ * Block until the event loop signals a worker.
+ */
+void __wait_for_jobs(Worker *worker) {
+  uint8_t buffer[64];
+#ifdef __linux__
+  ssize_t nbytes = read(worker->wakeup_fds[0], buffer, sizeof(uint64_t));
+#else
+  ssize_t nbytes = read(worker->wakeup_fds[0], buffer, sizeof(buffer));
+#endif
+  (void)nbytes;
+}
+
+/**
+ * Run the jobs of a worker as they arrive.
+ */
+void *__run_worker(void *arg) {
+  Worker *worker = (Worker *)arg;
+  NitrowsHandler *handler = get_handlers();
+  QueueNode *node = NULL;
+  WorkerJob *job = NULL;
+  is_worker = true;
+  while (1) {
+    __wait_for_jobs(worker);
+    queue_clear_signal(&worker->queue);
+    while ((node = queue_pop(&worker->queue)) != NULL) {
+      job = (WorkerJob *)node;
+      handled_socketfd = job->socketfd;
+      handled_generation = job->generation;
+      handled_message_type = job->type;
+      if (job->is_close) {
+        handler->handle_close(job->socketfd, job->userdata);
+      } else if (job->is_writable) {
+        handler->handle_writable(job->socketfd, job->userdata);
+      } else if (job->is_chunk) {
+        handler->handle_message_chunk(job->socketfd, job->data, job->length, job->is_last, job->userdata);
+      } else {
+        handler->handle_message(job->socketfd, job->data, job->length, job->userdata);
+      }
+      free(job);
+    }
+  }
+  return NULL;
+}
+
+void start_workers() {
+  if (requested_worker_count <= 0 || workers != NULL) {
+    return;
+  }
+  workers = (Worker *)calloc(requested_worker_count, sizeof(Worker));
+  if (workers == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (int i = 0; i < requested_worker_count; i++) {
+    Worker *worker = &workers[i];
+    queue_init(&worker->queue);
+#ifdef __linux__
+    worker->wakeup_fds[0] = worker->wakeup_fds[1] = eventfd(0, EFD_CLOEXEC);
+    if (worker->wakeup_fds[0] == -1) {
+      perror("eventfd");
+      exit(1);
+    }
+#else
+    if (pipe(worker->wakeup_fds) == -1) {
+      perror("pipe");
+      exit(1);
+    }
+    // Only the worker end blocks
+    fcntl(worker->wakeup_fds[1], F_SETFL, fcntl(worker->wakeup_fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+    if (pthread_create(&worker->thread, NULL, __run_worker, worker) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  worker_count = requested_worker_count;
+}
+
+/**
+ * Allocate a job for a client with room for its data.
+ */
+WorkerJob *__create_job(int socketfd, uint64_t generation, void *userdata, uint64_t length) {
+  WorkerJob *job = (WorkerJob *)calloc(1, sizeof(WorkerJob) + length);
+  if (job == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  job->socketfd = socketfd;
+  job->generation = generation;
+  job->userdata = userdata;
+  job->length = length;
+  return job;
+}
+
+/**
+ * Push a job to the worker its client is pinned to.
+ */
+void __push_job(WorkerJob *job) {
+  Worker *worker = &workers[job->socketfd % worker_count];
+  if (queue_push(&worker->queue, &job->node)) {
+    uint64_t value = 1;
+#ifdef __linux__
+    ssize_t written = write(worker->wakeup_fds[1], &value, sizeof(value));
+#else
+    ssize_t written = write(worker->wakeup_fds[1], &value, 1);
+#endif
+    (void)written;
+  }
+}
+
+/**
+ * Copy a message or chunk into a job and push it to the worker the client is pinned to.
+ */
+void __dispatch(Client *client, uint8_t *data, uint64_t length, bool is_chunk, bool is_last) {
+  WorkerJob *job = __create_job(client->socketfd, client->generation, client->userdata, length);
+  if (job == NULL) {
+    return;
+  }
+  job->is_chunk = is_chunk;
+  job->is_last = is_last;
+  memcpy(job->data, data, length);
+  // The type is only known while the loop is handling the message
+  job->type = (client->data_frame.type == TEXT) ? TEXT : BINARY;
+  __push_job(job);
+}
+
+void deliver_message(Client *client, uint8_t *message, uint64_t length) {
+  NitrowsHandler *handler = get_handlers();
+  if (worker_count > 0) {
+    __dispatch(client, message, length, handler->handle_message_chunk != NULL, true);
+    return;
+  }
+  handled_message_type = client->data_frame.type;
+  if (handler->handle_message_chunk != NULL) {
+    handler->handle_message_chunk(client->socketfd, message, length, true, client->userdata);
+  } else {
+    handler->handle_message(client->socketfd, message, length, client->userdata);
+  }
+  handled_message_type = INVALID;
+}
+
+void deliver_message_chunk(int socketfd, uint8_t *chunk, uint64_t length, bool is_last) {
+  // Extensions only know the socket of the client they stream for
+  Client *client = get_client(socketfd);
+  if (client == NULL) {
+    return;
+  }
+  if (worker_count > 0) {
+    __dispatch(client, chunk, length, true, is_last);
+    return;
+  }
+  handled_message_type = client->data_frame.type;
+  get_handlers()->handle_message_chunk(socketfd, chunk, length, is_last, client->userdata);
+  handled_message_type = INVALID;
+}
+
+void deliver_close(int socketfd, uint64_t generation, void *userdata) {
+  NitrowsHandler *handler = get_handlers();
+  if (handler->handle_close == NULL) {
+    return;
+  }
+  if (worker_count > 0) {
+    WorkerJob *job = __create_job(socketfd, generation, userdata, 0);
+    if (job == NULL) {
+      return;
+    }
+    job->is_close = true;
+    __push_job(job);
+  } else {
+    handler->handle_close(socketfd, userdata);
+  }
+}
+
+void deliver_writable(Client *client) {
+  NitrowsHandler *handler = get_handlers();
+  if (handler->handle_writable == NULL) {
+    return;
+  }
+  if (worker_count > 0) {
+    WorkerJob *job = __create_job(client->socketfd, client->generation, client->userdata, 0);
+    if (job == NULL) {
+      return;
+    }
+    job->is_writable = true;
+    __push_job(job);
+  } else {
+    handler->handle_writable(client->socketfd, client->userdata);
+  }
+}
@@ -0,0 +1,123 @@
+/**
+ * Optional pool of threads that run the message handlers, so slow handlers don't hold up the event loop. Each client
+ * is pinned to one worker, which keeps its messages in order. The event loop hands messages over through lock-free
+ * queues and the workers hand sends back through the send queue.
+ */
+#ifndef NITROWS_SRC_WORKERS_H
+#define NITROWS_SRC_WORKERS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "clients.h"
+#include "defs.h"
+#include "queue.h"
+
+/**
+ * A message, or a chunk of one, waiting to be handled by a worker. The data is copied right behind it. A job can also
+ * run the close or writable handler, which are queued behind the client's messages so they run in order with them.
+ */
+typedef struct WorkerJob WorkerJob;
+
+struct WorkerJob {
+  QueueNode node;  // Must be first, so a popped node is the job
+  int socketfd;
+  uint64_t generation;  // Generation of the client, which what the handler queues for it is tagged with
+  bool is_chunk;        // Goes to the chunk handler
+  bool is_last;         // Last chunk of the message
+  bool is_close;        // Goes to the close handler
+  bool is_writable;     // Goes to the writable handler
+  Opcode type;          // Type of the message, which replies are sent with
+  void *userdata;
+  uint64_t length;
+  uint8_t data[];
+};
+
+typedef struct Worker Worker;
+
+struct Worker {
+  pthread_t thread;
+  MPSCQueue queue;
+
+  // The worker blocks reading the first descriptor until the event loop writes to the second. Both are the same
+  // eventfd on Linux and the two ends of a pipe elsewhere.
+  int wakeup_fds[2];
+};
+
+/**
+ * Set the number of workers started by start_workers. 0 runs handlers on the event loop.
+ *
+ * @param count Number of workers
+ */
+void set_worker_count(int count);
+
+/**
+ * Start the workers, if any were asked for.
+ */
+void start_workers();
+
+/**
+ * Check if the current thread is a worker.
+ *
+ * @returns true if it's a worker, else false
+ */
+bool is_worker_thread();
+
+/**
+ * Get the generation to tag what the current thread queues for a client with. A worker knows the generation of the
+ * client it's handling, other clients are left to whichever client has the socket.
+ *
+ * @param socketfd Socket of the client
+ *
+ * @returns generation. 0 if it isn't known.
+ */
+uint64_t get_handled_client_generation(int socketfd);
+
+/**
+ * Get the type of the message the current thread is handling, which replies are sent with.
+ *
+ * @returns TEXT or BINARY. BINARY outside of a message handler.
+ */
+Opcode get_handled_message_type();
+
+/**
+ * Hand a complete message to the message handler, or the chunk handler if one is set. It runs on the client's worker
+ * if there are workers, else right away.
+ *
+ * @param client Client that sent the message
+ * @param message Message
+ * @param length Message length
+ */
+void deliver_message(Client *client, uint8_t *message, uint64_t length);
+
+/**
+ * Hand a chunk of a message to the chunk handler. It runs on the client's worker if there are workers, else right
+ * away.
+ *
+ * @param socketfd Socket for the client that sent the message
+ * @param chunk Message chunk
+ * @param length Chunk length
+ * @param is_last Whether it's the last chunk of the message
+ */
+void deliver_message_chunk(int socketfd, uint8_t *chunk, uint64_t length, bool is_last);
+
+/**
+ * Hand a closed client to the close handler, if one is set. It runs on the client's worker after the client's
+ * messages if there are workers, else right away.
+ *
+ * @param socketfd Socket the client had
+ * @param generation Generation the client had
+ * @param userdata The client's user data
+ */
+void deliver_close(int socketfd, uint64_t generation, void *userdata);
+
+/**
+ * Tell the writable handler, if one is set, that a client can be sent messages again. It runs on the client's worker
+ * after the client's messages if there are workers, else right away.
+ *
+ * @param client Client whose send buffer drained
+ */
+void deliver_writable(Client *client);
+
+#endif